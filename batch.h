@@ -0,0 +1,411 @@
+//---------------------------------------------------------
+//	Catlive
+//
+//		©2017 Yuichiro Nakada
+//---------------------------------------------------------
+
+// Batch transcoding of raw YUYV or Y4M files. The input is cut into GOP long
+// chunks, each starting with an I-picture, which the worker threads claim one
+// after the other and encode into their own buffers. The chunks are written in
+// order and make up one sequence.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define BATCH_WINDOW	2	// chunks in flight per thread
+
+typedef struct {
+	unsigned char *mem;	// encoded chunk
+	size_t len, size;
+	int done;
+} BATCH_CHUNK;
+
+typedef struct {
+	int fd;
+	int width, height;
+	int chroma;		// Y4M 420, 422, 444 or 0 for mono, -1: raw YUYV
+	long long start;	// offset of the first frame
+	long long frameSize;	// bytes of the picture planes
+	long long *offset;	// Y4M: planes of each frame, FRAME lines may carry parameters
+	int frames;
+	float fps;
+
+	int ow, oh, qscale;	// output
+	int chunk;		// pictures per chunk
+	int chunks, next, written;
+	int window;		// chunks encoded ahead of the writer
+	BATCH_CHUNK *slot;	// by chunk % window
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+} BATCH_OBJ;
+
+// buffers of a worker thread
+typedef struct {
+	BATCH_OBJ *b;
+	pthread_t thread;
+	jo_mpeg_t enc;
+	unsigned char *raw, *yuyv, *rgb;
+	unsigned char *pic[8];	// converted frames of a P-picture and its B-pictures
+	int cut[8];
+	int grey[8];		// of the frames in pic, coded luma only
+	unsigned short *acc;
+	MOTION_OBJ motion;
+	SCENE_OBJ scene;
+} BATCH_WORKER;
+
+static BATCH_OBJ batch;
+
+// Y4M with its own header, anything else is raw YUYV of width x height
+static void batch_open(BATCH_OBJ *b, const char *name, int width, int height, float fps)
+{
+	b->fd = open(name, O_RDONLY);
+	if (b->fd < 0) {
+		fprintf(stderr, "Cannot open '%s': %d, %s\n", name, errno, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	char h[256];
+	int n = pread(b->fd, h, sizeof(h)-1, 0);
+	h[n > 0 ? n : 0] = 0;
+	b->chroma = -1;
+	if (!strncmp(h, "YUV4MPEG2 ", 10)) {
+		char *end = strchr(h, '\n');
+		if (!end) {
+			fprintf(stderr, "Bad Y4M header in '%s'\n", name);
+			exit(EXIT_FAILURE);
+		}
+		*end = 0;
+		b->start = end - h + 1;
+		b->chroma = 420;
+		for (char *t = strtok(h+10, " "); t; t = strtok(0, " ")) {
+			int num, den;
+			switch (*t) {
+			case 'W': width = atoi(t+1); break;
+			case 'H': height = atoi(t+1); break;
+			case 'F':
+				if (sscanf(t+1, "%d:%d", &num, &den) == 2 && num > 0 && den > 0) fps = (float)num / den;
+				break;
+			case 'C': b->chroma = strncmp(t+1, "mono", 4) ? atoi(t+1) : 0; break;
+			}
+		}
+		if (b->chroma != 420 && b->chroma != 422 && b->chroma != 444 && b->chroma) {
+			fprintf(stderr, "Unsupported Y4M colour space in '%s'\n", name);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (width <= 0 || height <= 0 || (width & 1)) {
+		fprintf(stderr, "Bad frame size %dx%d, the width has to be even\n", width, height);
+		exit(EXIT_FAILURE);
+	}
+	b->width = width;
+	b->height = height;
+	b->fps = fps;
+
+	int cs = b->chroma == 420 ? width/2 * ((height+1)/2) : b->chroma == 422 ? width/2 * height : b->chroma == 444 ? width*height : 0;
+	b->frameSize = b->chroma < 0 ? width*height*2 : width*height + 2*cs;
+	struct stat st;
+	fstat(b->fd, &st);
+	if (b->chroma < 0) {
+		b->frames = (st.st_size - b->start) / b->frameSize;
+		return;
+	}
+
+	// every frame starts with "FRAME", optional parameters and a newline
+	int size = 0;
+	b->frames = 0;
+	for (long long pos = b->start; pos < st.st_size; b->frames++) {
+		n = pread(b->fd, h, sizeof(h)-1, pos);
+		h[n > 0 ? n : 0] = 0;
+		char *end = strchr(h, '\n');
+		if (strncmp(h, "FRAME", 5) || (h[5] != ' ' && h[5] != '\n') || !end) {
+			fprintf(stderr, "Bad Y4M frame header at frame %d in '%s'\n", b->frames, name);
+			exit(EXIT_FAILURE);
+		}
+		pos += end - h + 1;
+		if (pos + b->frameSize > st.st_size) break;
+		if (b->frames == size) {
+			size = size ? size*2 : 1024;
+			b->offset = (long long*)realloc(b->offset, size * sizeof(long long));
+			if (!b->offset) {
+				fprintf(stderr, "Out of memory\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		b->offset[b->frames] = pos;
+		pos += b->frameSize;
+	}
+}
+
+// frame i as YUYV, NULL when it cannot be read
+static unsigned char *batchRead(BATCH_OBJ *b, int i, unsigned char *raw, unsigned char *yuyv)
+{
+	long long pos = b->offset ? b->offset[i] : b->start + i*b->frameSize;
+	if (pread(b->fd, raw, b->frameSize, pos) != b->frameSize) return 0;
+	if (b->chroma < 0) return raw;
+
+	// pack the planes
+	int w = b->width, cw = b->chroma == 444 ? w : w/2;
+	const unsigned char *Y = raw;
+	const unsigned char *U = Y + w*b->height;
+	const unsigned char *V = U + (b->frameSize - w*b->height) / 2;
+	unsigned char *p = yuyv;
+	for (int y=0; y<b->height; y++) {
+		const unsigned char *l = Y + y*w;
+		int c = (b->chroma == 420 ? y/2 : y) * cw;
+		for (int x=0; x<w; x+=2, p+=4) {
+			int cx = c + (b->chroma == 444 ? x : x/2);
+			p[0] = l[x];
+			p[1] = b->chroma ? U[cx] : 128;
+			p[2] = l[x+1];
+			p[3] = b->chroma ? V[cx] : 128;
+		}
+	}
+	return yuyv;
+}
+
+// read frame i into dst at the output size, returns 1 on a scene cut;
+// mono Y4M, --mono and frames without colour come out grey
+static int batchFrame(BATCH_WORKER *w, int i, unsigned char *dst, int *grey)
+{
+	BATCH_OBJ *b = w->b;
+	unsigned char *yuyv = batchRead(b, i, w->raw, w->yuyv);
+	if (!yuyv) {
+		fprintf(stderr, "Cannot read frame %d\n", i);
+		exit(EXIT_FAILURE);
+	}
+	motion_grid(&w->motion, yuyv, b->width);
+	int cut = scene_cut(&w->scene, &w->motion);
+
+	*grey = v4l2.mono || !b->chroma || YUV422isGrey(b->width, b->height, yuyv);
+	unsigned char *rgb = b->ow == b->width && b->oh == b->height ? dst : w->rgb;
+	if (*grey) {
+		YUV422toGrey888(b->width, b->height, yuyv, rgb);
+	} else {
+		YUV422toRGB888(b->width, b->height, yuyv, rgb);
+	}
+	if (rgb != dst) {
+		scaleFrame(w->rgb, b->width, b->height, dst, b->ow, b->oh, w->acc);
+	}
+	return cut;
+}
+
+static void batchPicture(BATCH_CHUNK *k, jo_mpeg_t *e, const unsigned char *rgb, int grey, int type, int tref)
+{
+	size_t need = k->len + JO_MPEG_MAXSIZE(e->width, e->height);
+	if (need > k->size) {
+		k->size = need*2;
+		k->mem = (unsigned char*)realloc(k->mem, k->size);
+		if (!k->mem) {
+			fprintf(stderr, "Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	e->mono = grey;
+	k->len += jo_mpeg_picture(e, k->mem + k->len, rgb, type, tref);
+}
+
+// a chunk is a closed GOP, or more of them on scene cuts
+static void batchChunk(BATCH_WORKER *w, int c)
+{
+	BATCH_OBJ *b = w->b;
+	BATCH_CHUNK *k = &b->slot[c % b->window];
+	jo_mpeg_t *e = &w->enc;
+	unsigned char *ref = e->ref;
+	float *strip = e->strip;
+	int first = c*b->chunk, n = b->frames - first < b->chunk ? b->frames - first : b->chunk;
+	int m = outputCfg.anchor ? outputCfg.anchor : 1;
+
+	jo_mpeg_init(e, b->ow, b->oh, b->fps, b->qscale);
+	e->aq = outputCfg.aq;
+	if (outputCfg.matrix) {
+		jo_mpeg_matrix(e, outputCfg.matrix);
+	}
+	outputRoi(e, b->width, b->height);
+	e->gopMin = outputCfg.gopMin;
+	e->gopMax = outputCfg.gopMax;
+	e->ref = ref;
+	e->strip = strip;
+	e->search = outputCfg.anchor ? 8 : 0;
+	e->frame = first;	// time codes as if encoded in one go
+	w->motion.first = 1;
+	k->len = 0;
+
+	int have = 0;	// frames read ahead
+	for (int i=0; i<n; ) {
+		// same picture types as the live archive mode
+		int dist = e->tref + 1, j = 0, intra = 0;
+		for (; j < m && i+j < n; j++) {
+			if (j == have) {
+				w->cut[j] = batchFrame(w, first+i+j, w->pic[j], &w->grey[j]);
+				have++;
+			}
+			int d = dist + j;
+			if (!e->type || d >= e->gopMax || d >= 900 || (w->cut[j] && d >= e->gopMin) || (w->grey[j] && !e->grey[e->bwd])) {
+				intra = !j;
+				j += intra;
+				break;
+			}
+		}
+
+		if (intra) {
+			batchPicture(k, e, w->pic[0], w->grey[0], 1, 0);
+		} else {
+			batchPicture(k, e, w->pic[j-1], w->grey[j-1], 2, dist+j-1);
+			for (int x=0; x<j-1; x++) {
+				batchPicture(k, e, w->pic[x], w->grey[x], 3, dist+x);
+			}
+		}
+
+		// the frame that starts the next GOP was read already
+		for (int x=j; x<have; x++) {
+			unsigned char *t = w->pic[x-j];
+			w->pic[x-j] = w->pic[x];
+			w->pic[x] = t;
+			w->cut[x-j] = w->cut[x];
+			w->grey[x-j] = w->grey[x];
+		}
+		have -= j;
+		i += j;
+	}
+}
+
+static void *batchThread(void *arg)
+{
+	BATCH_WORKER *w = (BATCH_WORKER*)arg;
+	BATCH_OBJ *b = w->b;
+	rt_thread(RT_ENCODE, -1);
+
+	pthread_mutex_lock(&b->mutex);
+	for (;;) {
+		// stay within the window of the writer
+		while (b->next < b->chunks && b->next >= b->written + b->window) {
+			pthread_cond_wait(&b->cond, &b->mutex);
+		}
+		if (b->next >= b->chunks) break;
+		int c = b->next++;
+		pthread_mutex_unlock(&b->mutex);
+
+		batchChunk(w, c);
+
+		pthread_mutex_lock(&b->mutex);
+		b->slot[c % b->window].done = 1;
+		pthread_cond_broadcast(&b->cond);
+	}
+	pthread_mutex_unlock(&b->mutex);
+	return 0;
+}
+
+// transcode the file name into the output o with all cores
+static void batch_run(const char *name, OUTPUT_OBJ *o, int width, int height, float fps)
+{
+	BATCH_OBJ *b = &batch;
+	batch_open(b, name, width, height, fps);
+	b->ow = o->width ? o->width : b->width;
+	b->oh = o->height ? o->height : b->height;
+	b->qscale = o->qscale;
+	b->chunk = outputCfg.gopMax > 1 ? outputCfg.gopMax : 30;
+	b->chunks = (b->frames + b->chunk-1) / b->chunk;
+
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	threads = threads < 1 ? 1 : threads;
+	b->window = threads * BATCH_WINDOW;
+	b->slot = (BATCH_CHUNK*)calloc(b->window, sizeof(BATCH_CHUNK));
+	BATCH_WORKER *w = (BATCH_WORKER*)calloc(threads, sizeof(BATCH_WORKER));
+	if (!b->slot || !w) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	FILE *fp = fopen(o->name, "wb");
+	if (!fp) {
+		fprintf(stderr, "Cannot open '%s': %d, %s\n", o->name, errno, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	pthread_mutex_init(&b->mutex, 0);
+	pthread_cond_init(&b->cond, 0);
+	int m = outputCfg.anchor ? outputCfg.anchor : 1;
+	for (int i=0; i<threads; i++) {
+		w[i].b = b;
+		w[i].raw = (unsigned char*)rt_alloc(b->frameSize);
+		w[i].yuyv = (unsigned char*)rt_alloc(b->width*b->height*2);
+		w[i].rgb = (unsigned char*)rt_alloc(b->width*b->height*3);
+		w[i].acc = (unsigned short*)rt_alloc((b->width+16)*3*sizeof(unsigned short));
+		w[i].enc.strip = (float*)rt_alloc(JO_MPEG_STRIPSIZE(b->ow)*sizeof(float));
+		int ok = w[i].raw && w[i].yuyv && w[i].rgb && w[i].acc && w[i].enc.strip;
+		for (int j=0; j<m; j++) {
+			w[i].pic[j] = (unsigned char*)rt_alloc(b->ow*b->oh*3);
+			ok = ok && w[i].pic[j];
+		}
+		if (outputCfg.gopMax > 1) {
+			w[i].enc.ref = (unsigned char*)rt_alloc(JO_MPEG_REFSIZE(b->ow, b->oh));
+			ok = ok && w[i].enc.ref;
+		}
+		if (!ok) {
+			fprintf(stderr, "Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		motion_init(&w[i].motion, b->width, b->height, 0);
+		if (pthread_create(&w[i].thread, 0, batchThread, &w[i])) {
+			fprintf(stderr, "Cannot start the encoder threads\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	rt_thread(RT_WRITER, -1);
+
+	// write the chunks in order as they come in
+	pthread_mutex_lock(&b->mutex);
+	while (b->written < b->chunks) {
+		BATCH_CHUNK *k = &b->slot[b->written % b->window];
+		while (!k->done) {
+			pthread_cond_wait(&b->cond, &b->mutex);
+		}
+		pthread_mutex_unlock(&b->mutex);
+		fwrite(k->mem, k->len, 1, fp);
+		pthread_mutex_lock(&b->mutex);
+		k->done = 0;
+		b->written++;
+		pthread_cond_broadcast(&b->cond);
+	}
+	pthread_mutex_unlock(&b->mutex);
+
+	for (int i=0; i<threads; i++) {
+		pthread_join(w[i].thread, 0);
+	}
+	if (b->frames) {
+		unsigned char end[4];
+		fwrite(end, jo_mpeg_end(&w[0].enc, end), 1, fp);
+	}
+	fclose(fp);
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	float sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9f;
+	printf("%d frames in %d chunks on %d threads, %.1f fps\n", b->frames, b->chunks, threads, sec > 0 ? b->frames / sec : 0);
+
+	for (int i=0; i<threads; i++) {
+		rt_free(w[i].raw);
+		rt_free(w[i].yuyv);
+		rt_free(w[i].rgb);
+		rt_free(w[i].acc);
+		for (int j=0; j<m; j++) rt_free(w[i].pic[j]);
+		rt_free(w[i].enc.ref);
+		rt_free(w[i].enc.strip);
+		motion_free(&w[i].motion);
+	}
+	for (int i=0; i<b->window; i++) free(b->slot[i].mem);
+	free(b->slot);
+	free(w);
+	pthread_mutex_destroy(&b->mutex);
+	pthread_cond_destroy(&b->cond);
+	free(b->offset);
+	close(b->fd);
+}
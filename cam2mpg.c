@@ -5,23 +5,232 @@
 //---------------------------------------------------------
 
 #include "jo_mpeg.h"
+#include "rt.h"
 #include "v4l2.h"
+#include "mpgindex.h"
+#include "motion.h"
+#include "scene.h"
+#include "denoise.h"
+#include "stream.h"
+#include "shed.h"
+#include "output.h"
+#include "batch.h"
+#include "framebus.h"
+#include <signal.h>
 
-static char* outFilename = NULL;
+static float fps = 10;
+static int motionLevel = 0;	// 0: record everything
+static int preroll = 0;		// seconds kept before motion
+static int postroll = 2;	// seconds recorded after motion
+static int denoiseStrength = 0;	// 0: off
+static int shedLoad = 0;	// give up quality instead of falling behind
+static volatile sig_atomic_t quit = 0;
+static volatile sig_atomic_t snapshot = 0;	// SIGUSR1 asks for JPEG snapshots
+static char *batchName = 0;	// transcode this file instead of capturing
+static char *busName = 0;	// unix socket of the frame bus, NULL: none
+
+// Frame scheduler: puts captured frames on the output picture clock
+typedef struct {
+	long long t0;		// time of picture 0 in usec
+	long long n;		// next picture
+	int num, den;		// output frame rate
+} SCHED_OBJ;
+
+// pictures due with a frame captured at ts: 0 drops it, more repeat the last one
+static int schedule(SCHED_OBJ *s, long long ts)
+{
+	long long due = s->n ? ((ts - s->t0) * s->num + 500000LL * s->den) / (1000000LL * s->den) + 1 : 0;
+	if (!s->n || due < s->n || due - s->n > (long long)s->num / s->den) {
+		// first frame, clock jump or a gap of more than a second: start over
+		s->t0 = ts;
+		s->n = 1;
+		return 1;
+	}
+	int k = due - s->n;
+	s->n = due > s->n ? due : s->n;
+	return k;
+}
+
+// 64 values in raster order, separated by white space or commas
+static unsigned char *readMatrix(const char *name)
+{
+	static unsigned char m[64];
+	FILE *fp = fopen(name, "r");
+	if (!fp) {
+		fprintf(stderr, "Cannot open '%s': %d, %s\n", name, errno, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	for (int i=0; i<64; i++) {
+		int v;
+		if (fscanf(fp, " %d ,", &v) != 1 || v < 1 || v > 255) {
+			fprintf(stderr, "Bad quantizer matrix '%s'\n", name);
+			exit(EXIT_FAILURE);
+		}
+		m[i] = v;
+	}
+	fclose(fp);
+	return m;
+}
+
+static void stop(int sig)
+{
+	quit = 1;
+}
+
+static void snap(int sig)
+{
+	snapshot = 1;
+}
 
 void mainLoop()
 {
-	while (1) {
-		v4l2_frameRead();
+	MOTION_OBJ motion = {0};
+	SCENE_OBJ scene = {{{0}}};
+	SCHED_OBJ sched = {0};
+	DENOISE_OBJ denoise = {0};
+	SHED_OBJ shed;
+	int level = SHED_NONE;
+	int owed = 0;		// pictures of frames shed, repeated with the next one
+	long long hold = 0;	// record until
+	int last = -1;		// rec of the last posted frame, -1: none
 
-		static int count = 0;
-		printf("%d\n", count++);
-		FILE *fp = fopen(outFilename, "ab");
-		jo_write_mpeg(fp, v4l2.rgb, v4l2.width, v4l2.height, 10);  // frame 0
-		fclose(fp);
+	for (int i=0; i<n_outputs; i++) {
+		output_start(&outputs[i], v4l2.width, v4l2.height, fps);
+	}
+	jo_mpeg_rate(&outputs[0].enc, &sched.num, &sched.den);
+	shed_init(&shed, sched.num, sched.den);
+	// the luma grid feeds motion and scene cut detection
+	motion_init(&motion, v4l2.width, v4l2.height, motionLevel);
+	if (busName) {
+		framebus_open(&framebus, busName, v4l2.width, v4l2.height);
+	}
+	if (denoiseStrength) {
+		denoise_init(&denoise, v4l2.width, v4l2.height, denoiseStrength);
+	}
+	if (motionLevel) {
+		for (int i=0; i<n_outputs; i++) {
+			OUTPUT_OBJ *o = &outputs[i];
+			int n = preroll * sched.num / sched.den;
+			if (o->stream) continue;	// viewers see it live
+			// room for about half a byte per pixel and frame, older frames drop out first
+			preroll_init(&o->ring, n, n * o->width*o->height/2);
+		}
+	}
+	// after the other threads, they must not inherit it
+	rt_thread(RT_CAPTURE, -1);
 
-		nanosleep((const struct timespec[]){{ 0, 100000000L }}, NULL);	// sleeps for half a sec
+	while (!quit) {
+		int r = v4l2_frameWait(200);
+		if (r > 0) {
+			r = v4l2_frameRead();
+		}
+		if (r < 0 || (!r && v4l2_stalled())) {
+			// unplugged or stuck: reopen it, the outputs keep their files and clients
+			v4l2_recover(&quit);
+			continue;
+		}
+		if (!r) {
+			continue;
+		}
+		if (busName) {
+			// every captured frame, not just those on the output clock
+			framebus_publish(&framebus, v4l2.yuyv, v4l2.timestamp);
+		}
+
+		int n = schedule(&sched, v4l2.timestamp);
+		if (!n) {
+			continue;	// captured faster than the output rate
+		}
+
+		// shed frames: the next one repeats the last picture in their place
+		int busy = 0;
+		for (int i=0; i<n_outputs && level >= SHED_DROP; i++) {
+			busy |= output_busy(&outputs[i]);
+		}
+		// every second frame that would be coded, the picture number may step by more than 1
+		static int odd = 0;
+		if (last >= 0 && (busy || (level >= SHED_RATE && (odd ^= 1)))) {
+			owed += n;
+			shed.dropped += busy;
+			continue;
+		}
+		long long t0 = shed_now();
+
+		int cut = 0;
+		if (level < SHED_ANALYSIS) {
+			// everything downstream sees the filtered frame, so noise neither moves nor codes
+			if (denoiseStrength) {
+				v4l2.yuyv = denoise_frame(&denoise, v4l2.yuyv);
+			}
+			motion_grid(&motion, v4l2.yuyv, v4l2.width);
+			cut = scene_cut(&scene, &motion);
+		}
+
+		int rec = 1;
+		if (motionLevel) {
+			// without analysis nothing can be missed
+			if (level >= SHED_ANALYSIS || motion_detect(&motion)) {
+				hold = v4l2.timestamp + postroll*1000000LL;
+			}
+			rec = v4l2.timestamp < hold;
+		}
+
+		// encode only while recording or filling the pre-roll
+		if (!rec && !(motionLevel && preroll)) {
+			if (last >= 0) {
+				for (int i=0; i<n_outputs; i++) output_flush(&outputs[i]);
+			}
+			last = -1;
+			owed = 0;
+			continue;
+		}
+		long long t1 = shed_now();
+
+		// the workers still read the last frame
+		float coding = 0;
+		for (int i=0; i<n_outputs; i++) {
+			float c = output_wait(&outputs[i]);
+			coding = c > coding ? c : coding;
+		}
+		long long t2 = shed_now();
+		n += last == rec ? owed : 0;
+		owed = 0;
+
+		// one conversion shared by all outputs
+		v4l2_frameRGB();
+		int now = snapshot;
+		snapshot = 0;
+		for (int i=0; i<n_outputs; i++) {
+			OUTPUT_OBJ *o = &outputs[i];
+			// repeat only what went to the same place
+			output_post(o, v4l2.rgb, v4l2.width, v4l2.height, rec, last == rec ? n-1 : 0, cut, output_snapDue(o, v4l2.timestamp, now), v4l2.grey, level >= SHED_QUANT ? SHED_QBOOST : 0, v4l2.timestamp);
+		}
+		last = rec;
+
+		if (shedLoad) {
+			// the busiest stage sets the pace
+			float cost = (t1 - t0) + (shed_now() - t2);
+			cost = coding > cost ? coding : cost;
+			int l = shed_update(&shed, cost);
+			if (l < SHED_ANALYSIS && level >= SHED_ANALYSIS) {
+				// stale references after the break
+				motion.first = 1;
+				denoise.first = 1;
+			}
+			level = l;
+		}
+
+		if (rec) {
+			static int count = 0;
+			printf("%d\n", count++);
+		}
 	}
+
+	for (int i=0; i<n_outputs; i++) output_stop(&outputs[i]);
+	shed_report(&shed);
+	motion_free(&motion);
+	denoise_free(&denoise);
+	framebus_close(&framebus);
 }
 
 void usage(FILE* fp, int argc, char** argv)
@@ -31,28 +240,73 @@ void usage(FILE* fp, int argc, char** argv)
 		"Options:\n"
 		"-d | --device name   Video device name [/dev/video0]\n"
 		"-h | --help          Print this message\n"
-		"-o | --output        Output filename\n"
+		"-o | --output file   Output filename, repeat for more outputs\n"
+		"                     WxH[@q]:file scales to WxH with quantiser_scale q [8]\n"
+		"                     tcp:port or unix:path streams to any number of viewers\n"
+		"-J | --jpeg [sec:]file  JPEG snapshots of the output before, every sec seconds\n"
+		"                     and on SIGUSR1\n"
+		"-I | --index         Frame index file.idx next to each file, see mpgseek\n"
 		"-m | --mmap          Use memory mapped buffers\n"
 		"-r | --read          Use read() calls\n"
 		"-u | --userptr       Use application allocated buffers\n"
+		"-b | --batch file    Transcode raw YUYV of WxH or Y4M on all cores, no capture\n"
+		"-S | --share path    Serve raw frames to other processes in shared memory,\n"
+		"                     see framebus_client.h\n"
 		"-W | --width         width\n"
 		"-H | --height        height\n"
+		"-f | --fps rate      Frame rate [10], coded as the next MPEG rate\n"
+		"-g | --gop min:max   Pictures between I-pictures, scene cuts after min [12:300]\n"
+		"-B | --archive M[:N] B-pictures between I/P-pictures every M pictures, N per GOP [off]\n"
+		"-R | --roi x,y,w,h   Capture only this region of WxH, cropped by the driver if it can\n"
+		"                     x,y,w,h:q codes the whole frame, quantiser_scale q outside it\n"
+		"-a | --aq            Adapt the quantizer to the activity of each macroblock\n"
+		"-Y | --mono          Code luma only, as it is once the input has no colour\n"
+		"-Q | --qmatrix file  Intra quantizer matrix, 64 values in raster order\n"
+		"-N | --denoise k     Temporal denoise, thresholds k times the noise level [off]\n"
+		"-L | --shed          Give up quality, analysis and frame rate in that order\n"
+		"                     when frames take longer than the frame interval\n"
+		"-M | --motion level  Record only while the luma moves more than level [off]\n"
+		"-P | --preroll sec   Seconds kept before motion starts [0]\n"
+		"-A | --postroll sec  Seconds recorded after motion stops [2]\n"
+		"-C | --cpu [role:]cpus  Run capture, encode, writer or output n (1:) threads\n"
+		"                     on cpus like 0,2-3 or node1, all of them without a role\n"
+		"-F | --fifo prio     Capture with SCHED_FIFO at priority prio [off]\n"
+		"-G | --hugepages     Frame and scratch buffers from huge pages, locked in memory\n"
 		"",
 		argv[0]);
 }
 
-static const char short_options[] = "d:ho:mruW:H:";
+static const char short_options[] = "d:ho:J:Imrub:S:W:H:f:g:B:aR:Q:N:LM:P:A:C:F:GY";
 
 static const struct option
 	long_options[] = {
 	{ "device",     required_argument,      NULL,           'd' },
 	{ "help",       no_argument,            NULL,           'h' },
 	{ "output",     required_argument,      NULL,           'o' },
+	{ "jpeg",       required_argument,      NULL,           'J' },
+	{ "index",      no_argument,            NULL,           'I' },
 	{ "mmap",       no_argument,            NULL,           'm' },
 	{ "read",       no_argument,            NULL,           'r' },
 	{ "userptr",    no_argument,            NULL,           'u' },
+	{ "batch",      required_argument,      NULL,           'b' },
+	{ "share",      required_argument,      NULL,           'S' },
 	{ "width",      required_argument,      NULL,           'W' },
 	{ "height",     required_argument,      NULL,           'H' },
+	{ "fps",        required_argument,      NULL,           'f' },
+	{ "gop",        required_argument,      NULL,           'g' },
+	{ "archive",    required_argument,      NULL,           'B' },
+	{ "roi",        required_argument,      NULL,           'R' },
+	{ "aq",         no_argument,            NULL,           'a' },
+	{ "mono",       no_argument,            NULL,           'Y' },
+	{ "qmatrix",    required_argument,      NULL,           'Q' },
+	{ "denoise",    required_argument,      NULL,           'N' },
+	{ "shed",       no_argument,            NULL,           'L' },
+	{ "motion",     required_argument,      NULL,           'M' },
+	{ "preroll",    required_argument,      NULL,           'P' },
+	{ "postroll",   required_argument,      NULL,           'A' },
+	{ "cpu",        required_argument,      NULL,           'C' },
+	{ "fifo",       required_argument,      NULL,           'F' },
+	{ "hugepages",  no_argument,            NULL,           'G' },
 	{ 0, 0, 0, 0 }
 };
 
@@ -81,8 +335,20 @@ int main(int argc, char *argv[])
 			exit(EXIT_SUCCESS);
 
 		case 'o':
-			// set jpeg filename
-			outFilename = optarg;
+			// add an output
+			if (output_add(optarg)) {
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case 'J':
+			if (output_snapshot(optarg)) {
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case 'I':
+			outputCfg.index = 1;
 			break;
 
 		case 'm':
@@ -112,6 +378,14 @@ int main(int argc, char *argv[])
 #endif
 			break;
 
+		case 'b':
+			batchName = optarg;
+			break;
+
+		case 'S':
+			busName = optarg;
+			break;
+
 		case 'W':
 			// set width
 			v4l2.width = atoi(optarg);
@@ -122,6 +396,98 @@ int main(int argc, char *argv[])
 			v4l2.height = atoi(optarg);
 			break;
 
+		case 'f':
+			fps = atof(optarg);
+			break;
+
+		case 'g':
+			if (sscanf(optarg, "%d:%d", &outputCfg.gopMin, &outputCfg.gopMax) < 1 || outputCfg.gopMin < 1) {
+				fprintf(stderr, "Bad GOP '%s'\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			if (outputCfg.gopMax < outputCfg.gopMin) outputCfg.gopMax = outputCfg.gopMin;
+			break;
+
+		case 'B':
+			if (sscanf(optarg, "%d:%d", &outputCfg.anchor, &outputCfg.gopMax) < 1 || outputCfg.anchor < 1 || outputCfg.anchor > 8) {
+				fprintf(stderr, "Bad archive GOP '%s', M is 1..8\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case 'R': {
+			int *r = outputCfg.roi;
+			int n = sscanf(optarg, "%d,%d,%d,%d:%d", &r[0], &r[1], &r[2], &r[3], &outputCfg.bgQ);
+			if (n < 4 || r[0] < 0 || r[1] < 0 || r[2] < 1 || r[3] < 1 || (n == 5 && (outputCfg.bgQ < 1 || outputCfg.bgQ > 31))) {
+				fprintf(stderr, "Bad ROI '%s'\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			if (n == 4) {
+				// the rest of the frame is not needed at all
+				v4l2.roi.left = r[0];
+				v4l2.roi.top = r[1];
+				v4l2.roi.width = r[2];
+				v4l2.roi.height = r[3];
+				outputCfg.bgQ = 0;
+			}
+			break;
+		}
+
+		case 'a':
+			outputCfg.aq = 1;
+			break;
+
+		case 'Q':
+			outputCfg.matrix = readMatrix(optarg);
+			break;
+
+		case 'N':
+			denoiseStrength = atoi(optarg);
+			break;
+
+		case 'L':
+			shedLoad = 1;
+			break;
+
+		case 'M':
+			motionLevel = atoi(optarg);
+			if (motionLevel < 0 || motionLevel > 255) {
+				fprintf(stderr, "Bad motion level '%s', it is 0..255\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case 'P':
+			preroll = atoi(optarg);
+			break;
+
+		case 'A':
+			postroll = atoi(optarg);
+			break;
+
+		case 'C':
+			if (rt_cpus(optarg)) {
+				fprintf(stderr, "Bad cpus '%s'\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case 'F':
+			rt.fifo = atoi(optarg);
+			if (rt.fifo < sched_get_priority_min(SCHED_FIFO) || rt.fifo > sched_get_priority_max(SCHED_FIFO)) {
+				fprintf(stderr, "Bad SCHED_FIFO priority '%s'\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case 'G':
+			rt.huge = 1;
+			break;
+
+		case 'Y':
+			v4l2.mono = 1;
+			break;
+
 		default:
 			usage(stderr, argc, argv);
 			exit(EXIT_FAILURE);
@@ -129,19 +495,43 @@ int main(int argc, char *argv[])
 	}
 
 	// check for need parameters
-	if (!outFilename) {
-		fprintf(stderr, "You have to specify JPEG output filename!\n\n");
+	if (!n_outputs) {
+		fprintf(stderr, "You have to specify MPEG output filename!\n\n");
 		usage(stdout, argc, argv);
 		exit(EXIT_FAILURE);
 	}
 
-	v4l2_deviceOpen();
-	v4l2_captureStart();
+	if (batchName) {
+		if (n_outputs > 1) {
+			fprintf(stderr, "Batch mode writes one output\n");
+			exit(EXIT_FAILURE);
+		}
+		if (v4l2.roi.width) {
+			fprintf(stderr, "Batch mode codes whole frames, give the ROI a quantiser_scale\n");
+			exit(EXIT_FAILURE);
+		}
+		if (outputCfg.index) {
+			fprintf(stderr, "Batch mode has no capture times to index\n");
+			exit(EXIT_FAILURE);
+		}
+		batch_run(batchName, &outputs[0], v4l2.width, v4l2.height, fps);
+		return 0;
+	}
+
+	signal(SIGINT, stop);
+	signal(SIGTERM, stop);
+	signal(SIGUSR1, snap);
+
+	v4l2.fps = fps;
+	if (v4l2_deviceOpen() || v4l2_captureStart()) {
+		exit(EXIT_FAILURE);
+	}
 
 	mainLoop();
 
 	v4l2_captureStop();
 	v4l2_deviceClose();
+	v4l2_report();
 
 	return 0;
 }
@@ -0,0 +1,110 @@
+//---------------------------------------------------------
+//	Catlive
+//
+//		©2017 Yuichiro Nakada
+//---------------------------------------------------------
+
+// Temporal denoise of YUYV frames: a recursive filter that follows the
+// new frame where it differs by more than the noise, separately for Y and Cb/Cr.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define DENOISE_STEP	64	// bytes between the samples of the noise estimate
+
+typedef struct {
+	int strength;		// thresholds in multiples of the noise level, 0: off
+	int size;		// bytes per frame
+	unsigned char *frame;	// filtered frame, the reference for the next one
+	float noise[2];		// median frame difference of Y and of Cb/Cr
+	int first;
+} DENOISE_OBJ;
+
+static void denoise_init(DENOISE_OBJ *d, int width, int height, int strength)
+{
+	memset(d, 0, sizeof(DENOISE_OBJ));
+	d->strength = strength;
+	d->size = width*height*2;
+	d->frame = (unsigned char*)rt_alloc(d->size);
+	if (!d->frame) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	d->first = 1;
+}
+
+static void denoise_free(DENOISE_OBJ *d)
+{
+	rt_free(d->frame);
+	d->frame = 0;
+}
+
+// median absolute difference against the filtered frame, most of a picture does not move
+static void denoiseEstimate(DENOISE_OBJ *d, const unsigned char *yuyv)
+{
+	int hist[2][256], n = 0;
+	memset(hist, 0, sizeof(hist));
+	for (int i=0; i+4<=d->size; i+=DENOISE_STEP, n+=2) {
+		for (int j=0; j<4; j++) {
+			int v = yuyv[i+j] - d->frame[i+j];
+			hist[j&1][v < 0 ? -v : v]++;
+		}
+	}
+	for (int c=0; c<2; c++) {
+		int m = 0;
+		for (int s = hist[c][0]; s <= n/2 && m < 255; s += hist[c][++m]) {}
+		d->noise[c] = d->noise[c]*0.9f + m*0.1f;
+	}
+}
+
+static inline int denoisePixel(int p, int c, int t)
+{
+	int h = (p + c + 1) >> 1;
+	int v = c - p;
+	v = v < 0 ? -v : v;
+	return v <= t ? (p + h + 1) >> 1 : v <= 2*t ? h : c;
+}
+
+// filter a captured frame into d->frame, which is returned
+static unsigned char *denoise_frame(DENOISE_OBJ *d, const unsigned char *yuyv)
+{
+	unsigned char *p = d->frame;
+	if (d->first) {
+		d->first = 0;
+		memcpy(p, yuyv, d->size);
+		return p;
+	}
+	denoiseEstimate(d, yuyv);
+	int ty = d->strength * d->noise[0] + 1.5f;
+	int tc = d->strength * d->noise[1] + 1.5f;
+	ty = ty > 127 ? 127 : ty;
+	tc = tc > 127 ? 127 : tc;
+
+	int i = 0;
+#ifdef __SSE2__
+	const __m128i t1 = _mm_set1_epi32(ty | tc<<8 | ty<<16 | tc<<24);
+	const __m128i t2 = _mm_add_epi8(t1, t1);
+	const __m128i zero = _mm_setzero_si128();
+	for (; i+16<=d->size; i+=16) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(p+i));
+		__m128i b = _mm_loadu_si128((const __m128i*)(yuyv+i));
+		__m128i diff = _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+		__m128i half = _mm_avg_epu8(a, b);
+		__m128i quarter = _mm_avg_epu8(a, half);	// 3/4 of the filtered frame
+		// noise gets the strong filter, more than twice the noise is motion and passes
+		__m128i in1 = _mm_cmpeq_epi8(_mm_subs_epu8(diff, t1), zero);
+		__m128i in2 = _mm_cmpeq_epi8(_mm_subs_epu8(diff, t2), zero);
+		__m128i r = _mm_or_si128(_mm_and_si128(in2, half), _mm_andnot_si128(in2, b));
+		r = _mm_or_si128(_mm_and_si128(in1, quarter), _mm_andnot_si128(in1, r));
+		_mm_storeu_si128((__m128i*)(p+i), r);
+	}
+#endif
+	for (; i<d->size; i++) {
+		p[i] = denoisePixel(p[i], yuyv[i], i&1 ? tc : ty);
+	}
+	return p;
+}
@@ -0,0 +1,139 @@
+//---------------------------------------------------------
+//	Catlive
+//
+//		©2017 Yuichiro Nakada
+//---------------------------------------------------------
+
+// Frame bus: captured frames in a ring in shared memory for other processes.
+// The memfd is handed out on a unix socket, readers use framebus_client.h.
+// Each slot is a seqlock, so capture never waits for a reader.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include "framebus_client.h"
+
+#define FRAMEBUS_SLOTS	8
+
+typedef struct {
+	int fd;			// memfd
+	int sock;		// listening unix socket, -1: closed
+	const char *path;
+	FRAMEBUS_HEADER *h;
+	size_t size;
+	uint64_t n;		// frames published
+	pthread_t thread;
+} FRAMEBUS_OBJ;
+
+static FRAMEBUS_OBJ framebus = { -1, -1 };
+
+// hand the memfd to every reader that connects
+static void *framebusServe(void *arg)
+{
+	FRAMEBUS_OBJ *b = (FRAMEBUS_OBJ*)arg;
+	rt_thread(RT_WRITER, -1);
+	for (;;) {
+		int c = accept(b->sock, NULL, NULL);
+		if (c < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			break;	// shut down
+		}
+		char byte = 0;
+		struct iovec iov = { &byte, 1 };
+		union {
+			struct cmsghdr h;
+			char buf[CMSG_SPACE(sizeof(int))];
+		} ctl;
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		memset(&ctl, 0, sizeof(ctl));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = ctl.buf;
+		msg.msg_controllen = sizeof(ctl.buf);
+		struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		cm->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cm), &b->fd, sizeof(int));
+		sendmsg(c, &msg, MSG_NOSIGNAL);
+		close(c);
+	}
+	return 0;
+}
+
+static void framebus_open(FRAMEBUS_OBJ *b, const char *path, int width, int height)
+{
+	size_t page = getpagesize();
+	size_t frame = (size_t)width*height*2;
+	size_t head = (sizeof(FRAMEBUS_HEADER) + FRAMEBUS_SLOTS*sizeof(FRAMEBUS_SLOT) + page-1) & ~(page-1);
+	size_t stride = (frame + page-1) & ~(page-1);
+
+	b->path = path;
+	b->size = head + FRAMEBUS_SLOTS*stride;
+	b->fd = syscall(SYS_memfd_create, "cam2mpg-framebus", 0);
+	if (b->fd < 0 || ftruncate(b->fd, b->size) < 0) {
+		fprintf(stderr, "Cannot create the frame bus: %d, %s\n", errno, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	b->h = (FRAMEBUS_HEADER*)mmap(NULL, b->size, PROT_READ | PROT_WRITE, MAP_SHARED, b->fd, 0);
+	if (b->h == MAP_FAILED) {
+		fprintf(stderr, "Cannot map the frame bus: %d, %s\n", errno, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	b->h->width = width;
+	b->h->height = height;
+	b->h->fourcc = V4L2_PIX_FMT_YUYV;
+	b->h->slots = FRAMEBUS_SLOTS;
+	b->h->frameSize = frame;
+	b->h->offset = head;
+	b->h->stride = stride;
+	__atomic_store_n(&b->h->magic, FRAMEBUS_MAGIC, __ATOMIC_RELEASE);
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path)-1);
+	unlink(path);
+	b->sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (b->sock < 0 || bind(b->sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(b->sock, 8) < 0) {
+		fprintf(stderr, "Cannot listen on '%s': %d, %s\n", path, errno, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if (pthread_create(&b->thread, 0, framebusServe, b)) {
+		fprintf(stderr, "Cannot start the frame bus for '%s'\n", path);
+		exit(EXIT_FAILURE);
+	}
+}
+
+// copy a YUYV frame into the next slot and wake the readers
+static void framebus_publish(FRAMEBUS_OBJ *b, const unsigned char *yuyv, long long timestamp)
+{
+	FRAMEBUS_HEADER *h = b->h;
+	uint64_t n = ++b->n;
+	FRAMEBUS_SLOT *s = &h->slot[n % h->slots];
+
+	__atomic_store_n(&s->seq, 2*n+1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy((unsigned char*)h + h->offset + (n % h->slots) * h->stride, yuyv, h->frameSize);
+	s->timestamp = timestamp;
+	__atomic_store_n(&s->seq, 2*n+2, __ATOMIC_RELEASE);
+	__atomic_store_n(&h->head, n, __ATOMIC_RELEASE);
+
+	__atomic_add_fetch(&h->futex, 1, __ATOMIC_RELEASE);
+	syscall(SYS_futex, &h->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static void framebus_close(FRAMEBUS_OBJ *b)
+{
+	if (b->sock < 0) return;
+	shutdown(b->sock, SHUT_RDWR);	// ends accept()
+	pthread_join(b->thread, 0);
+	close(b->sock);
+	b->sock = -1;
+	unlink(b->path);
+	// readers keep their mapping
+	munmap(b->h, b->size);
+	close(b->fd);
+}
@@ -0,0 +1,166 @@
+//---------------------------------------------------------
+//	Catlive
+//
+//		©2017 Yuichiro Nakada
+//---------------------------------------------------------
+
+// Reader side of the cam2mpg frame bus (cam2mpg -S path), needs nothing else.
+// Frames are read in place; a frame can be overwritten while in use, so check
+// framebus_valid() after using it and drop the result if it fails.
+//
+//	FRAMEBUS_READER r;
+//	FRAMEBUS_FRAME f;
+//	if (framebus_connect(&r, "/run/cam2mpg.bus")) perror("framebus");
+//	for (;;) {
+//		if (!framebus_wait(&r, 1000) || !framebus_next(&r, &f)) continue;
+//		analyse(f.data, r.h->width, r.h->height);	// YUYV
+//		if (!framebus_valid(&r, &f)) discard();
+//	}
+//	framebus_disconnect(&r);
+
+#ifndef FRAMEBUS_CLIENT_H
+#define FRAMEBUS_CLIENT_H
+
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <linux/futex.h>
+
+#define FRAMEBUS_MAGIC	0x31737562	// "bus1"
+
+typedef struct {
+	uint64_t seq;		// 2n+1 while frame n is written, 2n+2 once it is complete
+	int64_t timestamp;	// capture time in usec
+} FRAMEBUS_SLOT;
+
+// start of the shared memory, the frames follow at offset + i*stride
+typedef struct {
+	uint32_t magic;
+	uint32_t width, height;
+	uint32_t fourcc;	// V4L2_PIX_FMT_YUYV
+	uint32_t slots;
+	uint32_t futex;		// changes with every frame
+	uint64_t frameSize, offset, stride;
+	uint64_t head;		// number of the newest complete frame, 0: none yet
+	FRAMEBUS_SLOT slot[];
+} FRAMEBUS_HEADER;
+
+typedef struct {
+	FRAMEBUS_HEADER *h;
+	size_t size;
+	uint64_t seq;		// last frame returned
+} FRAMEBUS_READER;
+
+typedef struct {
+	const unsigned char *data;
+	uint64_t seq;
+	int64_t timestamp;
+	uint64_t lost;		// frames published since the one before, but not returned
+} FRAMEBUS_FRAME;
+
+// map the bus served on the unix socket path, -1 and errno on error
+static inline int framebus_connect(FRAMEBUS_READER *r, const char *path)
+{
+	struct sockaddr_un addr;
+	char c;
+	struct iovec iov = { &c, 1 };
+	union {
+		struct cmsghdr h;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} ctl;
+	struct msghdr msg;
+	int s, fd = -1;
+
+	memset(r, 0, sizeof(FRAMEBUS_READER));
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path)-1);
+	s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s < 0) return -1;
+	if (connect(s, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		close(s);
+		return -1;
+	}
+
+	// the memfd comes as SCM_RIGHTS with one byte
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+	if (recvmsg(s, &msg, 0) == 1) {
+		struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+		if (cm && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+			memcpy(&fd, CMSG_DATA(cm), sizeof(int));
+		}
+	}
+	close(s);
+	if (fd < 0) {
+		errno = EPROTO;
+		return -1;
+	}
+
+	off_t size = lseek(fd, 0, SEEK_END);
+	void *p = size > 0 ? mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (p == MAP_FAILED) return -1;
+	r->h = (FRAMEBUS_HEADER*)p;
+	r->size = size;
+	if (r->h->magic != FRAMEBUS_MAGIC) {
+		munmap(p, size);
+		r->h = 0;
+		errno = EPROTO;
+		return -1;
+	}
+	return 0;
+}
+
+static inline void framebus_disconnect(FRAMEBUS_READER *r)
+{
+	if (r->h) munmap(r->h, r->size);
+	r->h = 0;
+}
+
+// 1 while the frame has not been overwritten
+static inline int framebus_valid(FRAMEBUS_READER *r, const FRAMEBUS_FRAME *f)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&r->h->slot[f->seq % r->h->slots].seq, __ATOMIC_RELAXED) == 2*f->seq+2;
+}
+
+// the newest frame if there is one after the last returned, 0: none
+static inline int framebus_next(FRAMEBUS_READER *r, FRAMEBUS_FRAME *f)
+{
+	for (;;) {
+		uint64_t n = __atomic_load_n(&r->h->head, __ATOMIC_ACQUIRE);
+		if (!n || n == r->seq) return 0;
+		FRAMEBUS_SLOT *s = &r->h->slot[n % r->h->slots];
+		if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != 2*n+2) continue;	// already reused
+		f->timestamp = s->timestamp;
+		f->data = (const unsigned char*)r->h + r->h->offset + (n % r->h->slots) * r->h->stride;
+		f->seq = n;
+		f->lost = r->seq ? n - r->seq - 1 : 0;
+		if (!framebus_valid(r, f)) continue;
+		r->seq = n;
+		return 1;
+	}
+}
+
+// wait up to msec for a frame newer than the last returned, 0 on timeout
+static inline int framebus_wait(FRAMEBUS_READER *r, int msec)
+{
+	struct timespec ts = { msec / 1000, (msec % 1000) * 1000000L };
+	uint32_t v = __atomic_load_n(&r->h->futex, __ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&r->h->head, __ATOMIC_ACQUIRE) != r->seq) return 1;
+	syscall(SYS_futex, &r->h->futex, FUTEX_WAIT, v, &ts, NULL, 0);
+	return __atomic_load_n(&r->h->head, __ATOMIC_ACQUIRE) != r->seq;
+}
+
+#endif
@@ -13,8 +13,56 @@
  *	...
  *	fclose(fp);
  *
+ * With a quantiser_scale other than 8 (1 best .. 31 smallest):
+ *	jo_mpeg_t e;
+ *	jo_mpeg_init(&e, width, height, 60, 12);
+ *	unsigned char *mem = malloc(JO_MPEG_MAXSIZE(width, height));
+ *	int size = jo_mpeg_encode(&e, mem, frame, 0);
+ *
+ * Adaptive quantization and an own intra quantizer matrix (raster order):
+ *	e.aq = 1;
+ *	jo_mpeg_matrix(&e, matrix);
+ *
+ * Only a region of interest at full quality, the rest at quantiser_scale 28:
+ *	jo_mpeg_roi(&e, x, y, w, h, 28);
+ *
+ * P-pictures that skip unchanged macroblocks, an I-picture at least every 300 pictures
+ * and on scene cuts that come 12 or more pictures after the last one:
+ *	e.ref = malloc(JO_MPEG_REFSIZE(width, height));
+ *	e.gopMin = 12;
+ *	e.gopMax = 300;
+ *	size = jo_mpeg_encode(&e, mem, frame, cut);  // e.type tells the picture type
+ * Each row of macroblocks is coded intra once every JO_MPEG_REFRESH P-pictures, against drift.
+ *
+ * Or pick the picture types yourself, e.g. B-pictures with motion search; code the P-picture
+ * before the B-pictures it follows in display order (tref counts from the I-picture):
+ *	e.search = 8;
+ *	jo_mpeg_picture(&e, mem, frame0, 1, 0);  // I
+ *	jo_mpeg_picture(&e, mem, frame3, 2, 3);  // P
+ *	jo_mpeg_picture(&e, mem, frame1, 3, 1);  // B
+ *	jo_mpeg_picture(&e, mem, frame2, 3, 2);  // B
+ *
+ * A baseline JPEG of a picture from the coefficients the encoder has anyway:
+ *	e.snap = malloc(JO_MPEG_SNAPSIZE(width, height)*sizeof(float));
+ *	size = jo_mpeg_encode(&e, mem, frame, cut);
+ *	size = jo_mpeg_jpeg(&e, jpg, 85);  // jpg holds JO_MPEG_JPEGSIZE(width, height) bytes
+ *	e.snap = 0;  // no more coefficients kept
+ *
+ * Grey input (night, IR) from the first channel only, with flat chroma and none of its maths;
+ * jo_mpeg_encode() starts a GOP when it follows colour, as the chroma of the anchor would linger:
+ *	e.mono = 1;
+ *
+ * Convert the input one macroblock row at a time, faster on wide pictures:
+ *	e.strip = malloc(JO_MPEG_STRIPSIZE(width)*sizeof(float));
+ *
+ * Hand out each slice as soon as it is coded, for low latency streaming:
+ *	e.slice = send;  // void send(void *arg, const unsigned char *p, int n)
+ *	e.sliceArg = arg;
+ *
+ * Pictures from jo_mpeg_encode(), jo_mpeg_picture() and jo_mpeg_skip() continue one sequence, close it with jo_mpeg_end().
+ *
  * Notes:
- * 	Only supports 24, 25, 30, 50, or 60 fps
+ * 	Only supports 23.976, 24, 25, 29.97, 30, 50, 59.94 or 60 fps, other rates are rounded up
  *
  * 	I don't know if decoders support changing of fps, or dimensions for each frame.
  * 	Movie players *should* support it as the spec allows it, but ...
@@ -30,6 +78,9 @@
 #include <stdio.h>
 #include <math.h>
 #include <memory.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 // Huffman tables
 static const unsigned char s_jo_HTDC_Y[9][2] = {{4,3}, {0,2}, {1,2}, {5,3}, {6,3}, {14,4}, {30,5}, {62,6}, {126,7}};
@@ -43,15 +94,95 @@ static const unsigned char s_jo_HTAC[32][40][2] = {
 	{{8,7},{42,13}},  {{14,8},{34,13}},  {{10,8},{34,14}},  {{78,9},{32,14}},  {{70,9},{52,17}},  {{68,9},{50,17}},  {{64,9},{48,17}},  {{28,11},{46,17}},  {{26,11},{44,17}},  {{16,11},{42,17}},
 	{{62,13}}, {{52,13}}, {{50,13}}, {{46,13}}, {{44,13}}, {{62,14}}, {{60,14}}, {{58,14}}, {{56,14}}, {{54,14}}, {{62,17}}, {{60,17}}, {{58,17}}, {{56,17}}, {{54,17}},
 };
-static const float s_jo_quantTbl[64] = {
-	0.015625f,0.005632f,0.005035f,0.004832f,0.004808f,0.005892f,0.007964f,0.013325f,
-	0.005632f,0.004061f,0.003135f,0.003193f,0.003338f,0.003955f,0.004898f,0.008828f,
-	0.005035f,0.003135f,0.002816f,0.003013f,0.003299f,0.003581f,0.005199f,0.009125f,
-	0.004832f,0.003484f,0.003129f,0.003348f,0.003666f,0.003979f,0.005309f,0.009632f,
-	0.005682f,0.003466f,0.003543f,0.003666f,0.003906f,0.004546f,0.005774f,0.009439f,
-	0.006119f,0.004248f,0.004199f,0.004228f,0.004546f,0.005062f,0.006124f,0.009942f,
-	0.008883f,0.006167f,0.006096f,0.005777f,0.006078f,0.006391f,0.007621f,0.012133f,
-	0.016780f,0.011263f,0.009907f,0.010139f,0.009849f,0.010297f,0.012133f,0.019785f,
+// default intra quantizer matrix, raster order
+static const unsigned char s_jo_intraMatrix[64] = {
+	8,16,19,22,26,27,29,34, 16,16,22,24,27,29,34,37, 19,22,26,27,29,34,34,38, 22,22,26,27,29,34,37,40,
+	22,26,27,29,32,35,40,48, 26,27,29,32,35,40,48,58, 26,27,29,34,38,46,56,69, 27,29,35,38,46,56,69,83,
+};
+// AAN DCT output scale per row/column
+static const float s_jo_aasf[8] = {
+	1.0f*2.828427125f, 1.387039845f*2.828427125f, 1.306562965f*2.828427125f, 1.175875602f*2.828427125f,
+	1.0f*2.828427125f, 0.785694958f*2.828427125f, 0.541196100f*2.828427125f, 0.275899379f*2.828427125f,
+};
+// macroblock_address_increment 1..33
+static const unsigned char s_jo_HTMBA[33][2] = {
+	{1,1}, {3,3}, {2,3}, {3,4}, {2,4}, {3,5}, {2,5}, {7,7}, {6,7}, {11,8}, {10,8}, {9,8}, {8,8}, {7,8}, {6,8},
+	{23,10}, {22,10}, {21,10}, {20,10}, {19,10}, {18,10}, {35,11}, {34,11}, {33,11}, {32,11}, {31,11}, {30,11},
+	{29,11}, {28,11}, {27,11}, {26,11}, {25,11}, {24,11},
+};
+// motion_code 0..16, all but 0 are followed by a sign bit
+static const unsigned char s_jo_HTMV[17][2] = {
+	{1,1}, {1,2}, {1,3}, {1,4}, {3,6}, {5,7}, {4,7}, {3,7}, {11,9}, {10,9}, {9,9}, {17,10}, {16,10}, {15,10}, {14,10}, {13,10}, {12,10},
+};
+// coded_block_pattern 1..63
+static const unsigned char s_jo_HTCBP[64][2] = {
+	{0,0}, {11,5}, {9,5}, {13,6}, {13,4}, {23,7}, {19,7}, {31,8}, {12,4}, {22,7}, {18,7}, {30,8}, {19,5}, {27,8}, {23,8}, {19,8},
+	{11,4}, {21,7}, {17,7}, {29,8}, {17,5}, {25,8}, {21,8}, {17,8}, {15,6}, {15,8}, {13,8}, {3,9}, {15,5}, {11,8}, {7,8}, {7,9},
+	{10,4}, {20,7}, {16,7}, {28,8}, {14,6}, {14,8}, {12,8}, {2,9}, {16,5}, {24,8}, {20,8}, {16,8}, {14,5}, {10,8}, {6,8}, {6,9},
+	{18,5}, {26,8}, {22,8}, {18,8}, {13,5}, {9,8}, {5,8}, {5,9}, {12,5}, {8,8}, {4,8}, {4,9}, {7,3}, {10,5}, {8,5}, {12,6},
+};
+// macroblock_type flags
+#define JO_MB_QUANT	1
+#define JO_MB_FWD	2
+#define JO_MB_BWD	4
+#define JO_MB_PAT	8
+#define JO_MB_INTRA	16
+
+// Cb and Cr of a grey intra macroblock: dct_dc_size 0 (DC 128 as predicted) and end_of_block each
+#define JO_MPEG_GREY_BITS	0x22
+#define JO_MPEG_GREY_SIZE	8
+
+// every macroblock row is coded intra once in this many P-pictures; MPEG-1 asks for it
+// at least every 132 predictive codings, or the IDCT mismatch of decoders drifts
+#define JO_MPEG_REFRESH	100
+// macroblock_type of P- and B-pictures by flags
+static const unsigned char s_jo_HTMBT[2][32][2] = {
+	{ [2]={1,3}, [8]={1,2}, [9]={1,5}, [10]={1,1}, [11]={2,5}, [16]={3,5}, [17]={1,6} },
+	{ [2]={2,4}, [4]={2,3}, [6]={2,2}, [10]={3,4}, [11]={3,6}, [12]={3,3}, [13]={2,6}, [14]={3,2}, [15]={2,5}, [16]={3,5}, [17]={1,6} },
+};
+// IDCT basis, C(u)/2 * cos((2x+1)u*pi/16)
+static const float s_jo_idct[64] = {
+	0.353553391f, 0.353553391f, 0.353553391f, 0.353553391f, 0.353553391f, 0.353553391f, 0.353553391f, 0.353553391f,
+	0.490392640f, 0.415734806f, 0.277785117f, 0.097545161f, -0.097545161f, -0.277785117f, -0.415734806f, -0.490392640f,
+	0.461939766f, 0.191341716f, -0.191341716f, -0.461939766f, -0.461939766f, -0.191341716f, 0.191341716f, 0.461939766f,
+	0.415734806f, -0.097545161f, -0.490392640f, -0.277785117f, 0.277785117f, 0.490392640f, 0.097545161f, -0.415734806f,
+	0.353553391f, -0.353553391f, -0.353553391f, 0.353553391f, 0.353553391f, -0.353553391f, -0.353553391f, 0.353553391f,
+	0.277785117f, -0.490392640f, 0.097545161f, 0.415734806f, -0.415734806f, -0.097545161f, 0.490392640f, -0.277785117f,
+	0.191341716f, -0.461939766f, 0.461939766f, -0.191341716f, -0.191341716f, 0.461939766f, -0.461939766f, 0.191341716f,
+	0.097545161f, -0.277785117f, 0.415734806f, -0.490392640f, 0.490392640f, -0.415734806f, 0.277785117f, -0.097545161f,
+};
+// JPEG Annex K quantization tables, raster order
+static const unsigned char s_jo_jpegQuant[2][64] = {
+	{16,11,10,16,24,40,51,61, 12,12,14,19,26,58,60,55, 14,13,16,24,40,57,69,56, 14,17,22,29,51,87,80,62,
+	 18,22,37,56,68,109,103,77, 24,35,55,64,81,104,113,92, 49,64,78,87,103,121,120,101, 72,92,95,98,112,100,103,99},
+	{17,18,24,47,99,99,99,99, 18,21,26,66,99,99,99,99, 24,26,56,99,99,99,99,99, 47,66,99,99,99,99,99,99,
+	 99,99,99,99,99,99,99,99, 99,99,99,99,99,99,99,99, 99,99,99,99,99,99,99,99, 99,99,99,99,99,99,99,99},
+};
+// JPEG Annex K Huffman tables: codes per length, then the values; DC Y, AC Y, DC C, AC C
+static const unsigned char s_jo_jpegBits[4][16] = {
+	{0,1,5,1,1,1,1,1,1,0,0,0,0,0,0,0}, {0,2,1,3,3,2,4,3,5,5,4,4,0,0,1,0x7d},
+	{0,3,1,1,1,1,1,1,1,1,1,0,0,0,0,0}, {0,2,1,2,4,4,3,4,7,5,4,4,0,1,2,0x77},
+};
+static const unsigned char s_jo_jpegDC[12] = {0,1,2,3,4,5,6,7,8,9,10,11};
+static const unsigned char s_jo_jpegAC[2][162] = {
+	{0x01,0x02,0x03,0x00,0x04,0x11,0x05,0x12,0x21,0x31,0x41,0x06,0x13,0x51,0x61,0x07,0x22,0x71,0x14,0x32,0x81,0x91,0xa1,0x08,
+	 0x23,0x42,0xb1,0xc1,0x15,0x52,0xd1,0xf0,0x24,0x33,0x62,0x72,0x82,0x09,0x0a,0x16,0x17,0x18,0x19,0x1a,0x25,0x26,0x27,0x28,
+	 0x29,0x2a,0x34,0x35,0x36,0x37,0x38,0x39,0x3a,0x43,0x44,0x45,0x46,0x47,0x48,0x49,0x4a,0x53,0x54,0x55,0x56,0x57,0x58,0x59,
+	 0x5a,0x63,0x64,0x65,0x66,0x67,0x68,0x69,0x6a,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x83,0x84,0x85,0x86,0x87,0x88,0x89,
+	 0x8a,0x92,0x93,0x94,0x95,0x96,0x97,0x98,0x99,0x9a,0xa2,0xa3,0xa4,0xa5,0xa6,0xa7,0xa8,0xa9,0xaa,0xb2,0xb3,0xb4,0xb5,0xb6,
+	 0xb7,0xb8,0xb9,0xba,0xc2,0xc3,0xc4,0xc5,0xc6,0xc7,0xc8,0xc9,0xca,0xd2,0xd3,0xd4,0xd5,0xd6,0xd7,0xd8,0xd9,0xda,0xe1,0xe2,
+	 0xe3,0xe4,0xe5,0xe6,0xe7,0xe8,0xe9,0xea,0xf1,0xf2,0xf3,0xf4,0xf5,0xf6,0xf7,0xf8,0xf9,0xfa},
+	{0x00,0x01,0x02,0x03,0x11,0x04,0x05,0x21,0x31,0x06,0x12,0x41,0x51,0x07,0x61,0x71,0x13,0x22,0x32,0x81,0x08,0x14,0x42,0x91,
+	 0xa1,0xb1,0xc1,0x09,0x23,0x33,0x52,0xf0,0x15,0x62,0x72,0xd1,0x0a,0x16,0x24,0x34,0xe1,0x25,0xf1,0x17,0x18,0x19,0x1a,0x26,
+	 0x27,0x28,0x29,0x2a,0x35,0x36,0x37,0x38,0x39,0x3a,0x43,0x44,0x45,0x46,0x47,0x48,0x49,0x4a,0x53,0x54,0x55,0x56,0x57,0x58,
+	 0x59,0x5a,0x63,0x64,0x65,0x66,0x67,0x68,0x69,0x6a,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x82,0x83,0x84,0x85,0x86,0x87,
+	 0x88,0x89,0x8a,0x92,0x93,0x94,0x95,0x96,0x97,0x98,0x99,0x9a,0xa2,0xa3,0xa4,0xa5,0xa6,0xa7,0xa8,0xa9,0xaa,0xb2,0xb3,0xb4,
+	 0xb5,0xb6,0xb7,0xb8,0xb9,0xba,0xc2,0xc3,0xc4,0xc5,0xc6,0xc7,0xc8,0xc9,0xca,0xd2,0xd3,0xd4,0xd5,0xd6,0xd7,0xd8,0xd9,0xda,
+	 0xe2,0xe3,0xe4,0xe5,0xe6,0xe7,0xe8,0xe9,0xea,0xf2,0xf3,0xf4,0xf5,0xf6,0xf7,0xf8,0xf9,0xfa},
+};
+// frame_rate_code 1..8 as num/den
+static const int s_jo_frameRate[9][2] = {
+	{0,1}, {24000,1001}, {24,1}, {25,1}, {30000,1001}, {30,1}, {50,1}, {60000,1001}, {60,1},
 };
 static const unsigned char s_jo_ZigZag[] = { 0,1,5,6,14,15,27,28,2,4,7,13,16,26,29,42,3,8,12,17,25,30,41,43,9,11,18,24,31,40,44,53,10,19,23,32,39,45,52,54,20,22,33,38,46,51,55,60,21,34,37,47,50,56,59,61,35,36,48,49,57,58,62,63 };
 
@@ -60,6 +191,53 @@ typedef struct {
 	int buf, cnt;
 } jo_bits_t;
 
+// worst case: every coefficient escape coded
+#define JO_MPEG_MAXSIZE(w, h)	(((w)+15)/16 * (((h)+15)/16) * (6*(64*28+16)/8 + 16) + ((h)+15)/16*8 + 64)
+// decoded pictures, 4:2:0: the two anchors and the one being coded
+#define JO_MPEG_REFSIZE(w, h)	(((w)+15)/16 * (((h)+15)/16) * 384 * 3)
+// DCT coefficients of a picture, in floats
+#define JO_MPEG_SNAPSIZE(w, h)	(((w)+15)/16 * (((h)+15)/16) * 384)
+// a macroblock row converted to Y, Cb, Cr: 16 lines of Y, 8 of Cb and Cr, two full size chroma lines, in floats
+#define JO_MPEG_STRIPSIZE(w)	(((w)+15)/16*16 * 28)
+// JPEG of a picture, every coefficient coded at most with 0xFF stuffing
+#define JO_MPEG_JPEGSIZE(w, h)	(((w)+15)/16 * (((h)+15)/16) * 6*420 + 1024)
+
+typedef struct {
+	int width, height;
+	int rate;		// frame_rate_code
+	int qscale;		// quantiser_scale, 1..31
+	unsigned char intraMatrix[64];	// raster order
+	int loadMatrix;		// send intraMatrix in the sequence header
+	float quantTbl[32][64];	// intra quantizer per quantiser_scale folded with the DCT scale
+	float interTbl[32][64];	// non-intra quantizer, flat matrix
+
+	int aq;			// adapt quantiser_scale per macroblock to its activity
+	float avgAct, sumAct;	// mean activity of the last picture, running sum
+
+	int frame;		// pictures written, for the GOP time code
+	int tref;		// temporal_reference in the current GOP
+	int type;		// picture_coding_type of the last picture, 0: none yet
+
+	int gopMin, gopMax;	// pictures between I-pictures, scene cuts honoured after gopMin
+	int skipLevel;		// SAD of an 8x8 block that still counts as unchanged
+	int search;		// motion search range in pixels, 0..31, 0: zero vectors only
+	unsigned char *ref;	// JO_MPEG_REFSIZE bytes for P- and B-pictures, NULL: I-pictures only
+	int fwd, bwd;		// older and newer anchor in ref
+	int pcount;		// P-pictures since the I-picture, for the intra refresh
+
+	int roi[4];		// macroblocks x0, y0, x1, y1 coded at qscale
+	int bgQ;		// quantiser_scale of the others, 0: no region
+
+	float *snap;		// JO_MPEG_SNAPSIZE floats for the DCT of each picture, NULL: none
+
+	float *strip;		// JO_MPEG_STRIPSIZE floats to convert a macroblock row at once, NULL: each macroblock
+	int mono;		// grey pictures: luma from the first channel, chroma flat 128
+	unsigned char grey[3];	// decoded pictures in ref with flat chroma
+
+	void (*slice)(void *arg, const unsigned char *p, int n);	// gets each slice once coded, NULL: none
+	void *sliceArg;
+} jo_mpeg_t;
+
 //#include <stdint.h>
 //typedef short	uint4_t;
 inline void put1b(unsigned char c, unsigned char **p)
@@ -118,6 +296,14 @@ static void jo_writeBits(jo_bits_t *b, int value, int count)
 	}
 }
 
+// pad to a byte boundary
+static void jo_flushBits(jo_bits_t *b)
+{
+	if (b->cnt) {
+		jo_writeBits(b, 0, 8 - b->cnt);
+	}
+}
+
 static void jo_DCT(float *d0, float *d1, float *d2, float *d3, float *d4, float *d5, float *d6, float *d7)
 {
 	float tmp0 = *d0 + *d7;
@@ -162,7 +348,52 @@ static void jo_DCT(float *d0, float *d1, float *d2, float *d3, float *d4, float
 	*d7 = z11 - z4;
 }
 
-static int jo_processDU(jo_bits_t *bits, float A[64], const unsigned char htdc[9][2], int DC)
+// MPEG intra: QF = 8*F / (qscale*W), DC always divided by 8; non-intra (matrix NULL): QF = F / (2*qscale)
+// what the default intra matrix at quantiser_scale 8 always used, kept to the digit
+static const float s_jo_quantTbl[64] = {
+	0.015625f,0.005632f,0.005035f,0.004832f,0.004808f,0.005892f,0.007964f,0.013325f,
+	0.005632f,0.004061f,0.003135f,0.003193f,0.003338f,0.003955f,0.004898f,0.008828f,
+	0.005035f,0.003135f,0.002816f,0.003013f,0.003299f,0.003581f,0.005199f,0.009125f,
+	0.004832f,0.003484f,0.003129f,0.003348f,0.003666f,0.003979f,0.005309f,0.009632f,
+	0.005682f,0.003466f,0.003543f,0.003666f,0.003906f,0.004546f,0.005774f,0.009439f,
+	0.006119f,0.004248f,0.004199f,0.004228f,0.004546f,0.005062f,0.006124f,0.009942f,
+	0.008883f,0.006167f,0.006096f,0.005777f,0.006078f,0.006391f,0.007621f,0.012133f,
+	0.016780f,0.011263f,0.009907f,0.010139f,0.009849f,0.010297f,0.012133f,0.019785f,
+};
+
+static void jo_quantTable(float tbl[64], const unsigned char *matrix, int qscale)
+{
+	if (matrix && qscale == 8 && !memcmp(matrix, s_jo_intraMatrix, 64)) {
+		memcpy(tbl, s_jo_quantTbl, sizeof(s_jo_quantTbl));
+		return;
+	}
+	for (int i=0; i<64; i++) {
+		float d = !matrix ? 2.f*qscale : i ? qscale*matrix[i] / 8.f : 8.f;
+		tbl[i] = 1.f / (d * s_jo_aasf[i>>3] * s_jo_aasf[i&7]);
+	}
+}
+
+// 1 + the smallest variance of the four luma blocks
+static float jo_activity(const float Y[256])
+{
+	float act = 1e30f;
+	for (int k=0; k<4; k++) {
+		const float *b = Y + (k>>1)*128 + (k&1)*8;
+		float sum = 0, sum2 = 0;
+		for (int i=0; i<128; i+=16) {
+			for (int j=0; j<8; j++) {
+				sum += b[i+j];
+				sum2 += b[i+j]*b[i+j];
+			}
+		}
+		float var = sum2/64 - (sum/64)*(sum/64);
+		act = var < act ? var : act;
+	}
+	return 1 + act;
+}
+
+// 2D AAN forward DCT in place, the output is scaled by s_jo_aasf
+static void jo_fdct(float A[64])
 {
 	for (int dataOff=0; dataOff<64; dataOff+=8) {
 		jo_DCT(&A[dataOff], &A[dataOff+1], &A[dataOff+2], &A[dataOff+3], &A[dataOff+4], &A[dataOff+5], &A[dataOff+6], &A[dataOff+7]);
@@ -170,31 +401,27 @@ static int jo_processDU(jo_bits_t *bits, float A[64], const unsigned char htdc[9
 	for (int dataOff=0; dataOff<8; ++dataOff) {
 		jo_DCT(&A[dataOff], &A[dataOff+8], &A[dataOff+16], &A[dataOff+24], &A[dataOff+32], &A[dataOff+40], &A[dataOff+48], &A[dataOff+56]);
 	}
-	int Q[64];
-	for (int i=0; i<64; ++i) {
-		float v = A[i]*s_jo_quantTbl[i];
-		Q[s_jo_ZigZag[i]] = (int)(v < 0 ? ceilf(v - 0.5f) : floorf(v + 0.5f));
-	}
+}
 
-	DC = Q[0] - DC;
-	int aDC = DC < 0 ? -DC : DC;
-	int size = 0;
-	int tempval = aDC;
-	while (tempval) {
-		size++;
-		tempval >>= 1;
-	}
-	jo_writeBits(bits, htdc[size][0], htdc[size][1]);
-	if (DC < 0) {
-		aDC ^= (1 << size) - 1;
+// quantize into zigzag order, intra levels are rounded, non-intra ones truncated
+static void jo_quantize(const float A[64], const float *quantTbl, int Q[64], int intra)
+{
+	for (int i=0; i<64; ++i) {
+		float v = A[i]*quantTbl[i];
+		v = v < -255 ? -255 : v > 255 ? 255 : v;	// escape range
+		Q[s_jo_ZigZag[i]] = intra ? (int)(v < 0 ? ceilf(v - 0.5f) : floorf(v + 0.5f)) : (int)v;
 	}
-	jo_writeBits(bits, aDC, size);
+}
 
+// run/level codes from coefficient i on and end_of_block, i is 0 for non-intra blocks
+static void jo_writeAC(jo_bits_t *bits, const int Q[64], int i)
+{
 	int endpos = 63;
 	for (; (endpos>0)&&(Q[endpos]==0); --endpos) {
 		/* do nothing */
 	}
-	for (int i = 1; i <= endpos;) {
+	int first = !i;
+	for (; i <= endpos;) {
 		int run = 0;
 		while (Q[i]==0 && i<endpos) {
 			++run;
@@ -203,13 +430,18 @@ static int jo_processDU(jo_bits_t *bits, float A[64], const unsigned char htdc[9
 		int AC = Q[i++];
 		int aAC = AC < 0 ? -AC : AC;
 		int code = 0, size = 0;
-		if (run<32 && aAC<=41) {
+		if (first && !run && aAC == 1) {
+			// first coefficient of a non-intra block
+			code = AC < 0 ? 3 : 2;
+			size = 2;
+		} else if (run<32 && aAC<=40) {
 			code = s_jo_HTAC[run][aAC-1][0];
 			size = s_jo_HTAC[run][aAC-1][1];
 			if (AC < 0) {
 				code += 1;
 			}
 		}
+		first = 0;
 		if (!size) {
 			jo_writeBits(bits, 1, 6);
 			jo_writeBits(bits, run, 6);
@@ -224,90 +456,956 @@ static int jo_processDU(jo_bits_t *bits, float A[64], const unsigned char htdc[9
 		jo_writeBits(bits, code, size);
 	}
 	jo_writeBits(bits, 2, 2);
+}
 
+// intra block, Q receives the levels
+static int jo_processDU(jo_bits_t *bits, float A[64], const float *quantTbl, const unsigned char htdc[9][2], int DC, int Q[64])
+{
+	jo_fdct(A);
+	jo_quantize(A, quantTbl, Q, 1);
+
+	DC = Q[0] - DC;
+	int aDC = DC < 0 ? -DC : DC;
+	int size = 0;
+	int tempval = aDC;
+	while (tempval) {
+		size++;
+		tempval >>= 1;
+	}
+	jo_writeBits(bits, htdc[size][0], htdc[size][1]);
+	if (DC < 0) {
+		aDC ^= (1 << size) - 1;
+	}
+	jo_writeBits(bits, aDC, size);
+
+	jo_writeAC(bits, Q, 1);
 	return Q[0];
 }
 
-int encode_mpeg(unsigned char *mem, const unsigned char *rgbx, int width, int height, int fps)
+// what the decoder makes of a block: inverse quantization and IDCT, matrix is NULL for non-intra
+static void jo_reconDU(const int Q[64], int qscale, const unsigned char *matrix, float out[64])
+{
+	float F[64], T[64];
+	for (int i=0; i<64; i++) {
+		int l = Q[s_jo_ZigZag[i]], v = 0;
+		if (matrix && !i) {
+			v = l*8;
+		} else if (l) {
+			v = matrix ? 2*l*qscale*matrix[i] / 16 : (2*l + (l > 0 ? 1 : -1)) * qscale;
+			if (!(v & 1)) {
+				v -= (v > 0) - (v < 0);	// oddification
+			}
+			v = v < -2048 ? -2048 : v > 2047 ? 2047 : v;
+		}
+		F[i] = v;
+	}
+	for (int y=0; y<64; y+=8) {
+		for (int x=0; x<8; x++) {
+			float s = 0;
+			for (int u=0; u<8; u++) s += F[y+u] * s_jo_idct[u*8+x];
+			T[y+x] = s;
+		}
+	}
+	for (int y=0; y<8; y++) {
+		for (int x=0; x<8; x++) {
+			float s = 0;
+			for (int v=0; v<8; v++) s += T[v*8+x] * s_jo_idct[v*8+y];
+			out[y*8+x] = s;
+		}
+	}
+}
+
+// smallest MPEG frame rate at or above fps, 23.976/29.97/59.94 only when asked for
+static int jo_rateCode(float fps)
+{
+	for (int i=1; i<9; i++) {
+		float r = (float)s_jo_frameRate[i][0] / s_jo_frameRate[i][1];
+		if (s_jo_frameRate[i][1] > 1 ? fabsf(fps - r) < 0.005f : fps <= r + 0.005f) {
+			return i;
+		}
+	}
+	return 8;
+}
+
+// intra quantizer matrix in raster order, NULL for the default one
+void jo_mpeg_matrix(jo_mpeg_t *e, const unsigned char *matrix)
+{
+	e->loadMatrix = matrix != 0;
+	memcpy(e->intraMatrix, matrix ? matrix : s_jo_intraMatrix, 64);
+	e->intraMatrix[0] = 8;
+	for (int q=1; q<32; q++) {
+		jo_quantTable(e->quantTbl[q], e->intraMatrix, q);
+	}
+}
+
+void jo_mpeg_init(jo_mpeg_t *e, int width, int height, float fps, int qscale)
+{
+	memset(e, 0, sizeof(jo_mpeg_t));
+	e->width = width;
+	e->height = height;
+	e->rate = jo_rateCode(fps);
+	e->qscale = qscale < 1 ? 1 : qscale > 31 ? 31 : qscale;
+	jo_mpeg_matrix(e, 0);
+	for (int q=1; q<32; q++) {
+		jo_quantTable(e->interTbl[q], 0, q);
+	}
+	e->gopMin = e->gopMax = 1;
+	e->skipLevel = 64 + 16*e->qscale;
+	e->fwd = 0;
+	e->bwd = 1;
+}
+
+// macroblocks touching the w x h rectangle at x, y keep qscale, the rest get q
+void jo_mpeg_roi(jo_mpeg_t *e, int x, int y, int w, int h, int q)
+{
+	e->roi[0] = x / 16;
+	e->roi[1] = y / 16;
+	e->roi[2] = (x + w + 15) / 16;
+	e->roi[3] = (y + h + 15) / 16;
+	e->bgQ = q < 0 ? 0 : q > 31 ? 31 : q;
+}
+
+// the frame rate actually coded, as num/den
+void jo_mpeg_rate(jo_mpeg_t *e, int *num, int *den)
+{
+	*num = s_jo_frameRate[e->rate][0];
+	*den = s_jo_frameRate[e->rate][1];
+}
+
+static void jo_pictureHeader(jo_bits_t *bits, int tref, int type, int fcode)
+{
+	jo_writeBits(bits, 0, 16); // PIC header
+	jo_writeBits(bits, 0x100, 16);
+	jo_writeBits(bits, tref, 10);
+	jo_writeBits(bits, type, 3);
+	jo_writeBits(bits, 0xFFFF, 16); // vbv_delay
+	if (type >= 2) {
+		jo_writeBits(bits, fcode, 4); // full_pel_forward_vector 0, forward_f_code
+	}
+	if (type == 3) {
+		jo_writeBits(bits, fcode, 4); // full_pel_backward_vector 0, backward_f_code
+	}
+	jo_writeBits(bits, 0, 1); // extra_bit_picture
+	jo_flushBits(bits);
+}
+
+static void jo_macroblockAddress(jo_bits_t *bits, int inc)
+{
+	for (; inc > 33; inc -= 33) {
+		jo_writeBits(bits, 8, 11); // macroblock_escape
+	}
+	jo_writeBits(bits, s_jo_HTMBA[inc-1][0], s_jo_HTMBA[inc-1][1]);
+}
+
+// f_code that holds half-pel vectors of search pixels
+static int jo_fcode(int search)
+{
+	return search < 8 ? 1 : search < 16 ? 2 : search < 32 ? 3 : 4;
+}
+
+// one component of a motion vector, coded against its predictor
+static void jo_motionVector(jo_bits_t *bits, int v, int pred, int fcode)
+{
+	int f = 1 << (fcode-1);
+	int d = v - pred;
+	if (d < -16*f) {
+		d += 32*f;
+	} else if (d > 16*f-1) {
+		d -= 32*f;
+	}
+	if (!d) {
+		jo_writeBits(bits, 1, 1);
+		return;
+	}
+	int a = d < 0 ? -d : d;
+	int code = (a-1) / f + 1;
+	jo_writeBits(bits, s_jo_HTMV[code][0], s_jo_HTMV[code][1]);
+	jo_writeBits(bits, d < 0, 1);
+	if (f > 1) {
+		jo_writeBits(bits, (a-1) % f, fcode-1);
+	}
+}
+
+// P-picture with every macroblock skipped, shows the last picture again
+int jo_mpeg_skip(jo_mpeg_t *e, unsigned char *mem)
 {
 	unsigned char *smem = mem;
-	int lastDCY = 128, lastDCCR = 128, lastDCCB = 128;
 	jo_bits_t bits = {&mem};
+	int mbs = ((e->width+15)/16) * ((e->height+15)/16);
 
-	// Sequence Header
-	put4b("\x00\x00\x01\xB3", &mem);
-	// 12 bits for width, height
-	put1b((width>>4)&0xFF, &mem);
-	put1b(((width&0xF)<<4) | ((height>>8) & 0xF), &mem);
-	put1b(height & 0xFF, &mem);
-	// aspect ratio, framerate
-	if (fps <= 24) {
-		put1b(0x12, &mem);
-	} else if (fps <= 25) {
-		put1b(0x13, &mem);
-	} else if (fps <= 30) {
-		put1b(0x15, &mem);
-	} else if (fps <= 50) {
-		put1b(0x16, &mem);
-	} else {
-		put1b(0x18, &mem);	// 60fps
-	}
-	put4b("\xFF\xFF\xE0\xA0", &mem);
-
-	put8b("\x00\x00\x01\xB8\x80\x08\x00\x40", &mem); // GOP header
-	put8b("\x00\x00\x01\x00\x00\x0C\x00\x00", &mem); // PIC header
+	jo_pictureHeader(&bits, ++e->tref, 2, 1);
 	put4b("\x00\x00\x01\x01", &mem); // Slice header
-	jo_writeBits(&bits, 0x10, 6);
+	jo_writeBits(&bits, e->qscale<<1, 6);
+
+	// a slice has to start and end with a coded macroblock, no motion and no coefficients
+	jo_writeBits(&bits, 1, 1);
+	jo_writeBits(&bits, 1, 3); // macroblock_type, motion forward not coded
+	jo_writeBits(&bits, 3, 2); // motion vector 0,0
+	if (mbs > 1) {
+		jo_macroblockAddress(&bits, mbs-1);
+		jo_writeBits(&bits, 1, 3);
+		jo_writeBits(&bits, 3, 2);
+	}
+	jo_flushBits(&bits);
+	e->frame++;
+	return mem-smem;
+}
+
+int jo_mpeg_end(jo_mpeg_t *e, unsigned char *mem)
+{
+	unsigned char *smem = mem;
+	e->type = 0;
+	put4b("\x00\x00\x01\xb7", &mem); // End of Sequence
+	return mem-smem;
+}
+
+// plane c (0: Y, 1: Cb, 2: Cr) of decoded picture k in e->ref
+static unsigned char *jo_plane(jo_mpeg_t *e, int k, int c)
+{
+	int mbs = ((e->width+15)/16) * ((e->height+15)/16);
+	return e->ref + (k*384 + (c ? 192 + c*64 : 0)) * mbs;
+}
+
+// start and stride of block k in a macroblock of 16x16 Y, 8x8 Cb and 8x8 Cr
+static int jo_blockOffset(int k, int *stride)
+{
+	*stride = k < 4 ? 16 : 8;
+	return k < 4 ? (k>>1)*128 + (k&1)*8 : 256 + (k-4)*64;
+}
+
+// n x n pixels at (x,y) moved by the half-pel vector (vx,vy)
+static void jo_predict(unsigned char *dst, const unsigned char *ref, int stride, int x, int y, int vx, int vy, int n)
+{
+	const unsigned char *p = ref + (y + (vy>>1))*stride + x + (vx>>1);
+	int hx = vx&1, hy = (vy&1)*stride;
+	for (int j=0; j<n; j++, p+=stride, dst+=n) {
+		for (int i=0; i<n; i++) {
+			dst[i] = (p[i] + p[i+hx] + p[i+hy] + p[i+hx+hy] + 2) >> 2;
+		}
+	}
+}
+
+// macroblock at (x,y) of decoded picture k moved by a luma vector, chroma vectors are half of it;
+// the flat chroma of grey pictures needs no prediction
+static void jo_predictMB(jo_mpeg_t *e, unsigned char P[384], int k, int x, int y, const int v[2], int flat)
+{
+	int stride = (e->width+15)/16*16;
+	jo_predict(P, jo_plane(e, k, 0), stride, x, y, v[0], v[1], 16);
+	if (flat) {
+		memset(P+256, 128, 128);
+		return;
+	}
+	jo_predict(P+256, jo_plane(e, k, 1), stride/2, x/2, y/2, v[0]/2, v[1]/2, 8);
+	jo_predict(P+320, jo_plane(e, k, 2), stride/2, x/2, y/2, v[0]/2, v[1]/2, 8);
+}
+
+static void jo_storeMB(jo_mpeg_t *e, int k, int x, int y, const unsigned char R[384])
+{
+	int stride = (e->width+15)/16*16;
+	unsigned char *p = jo_plane(e, k, 0) + y*stride + x;
+	for (int j=0; j<16; j++) {
+		memcpy(p + j*stride, R + j*16, 16);
+	}
+	for (int c=1; c<3; c++) {
+		p = jo_plane(e, k, c) + y/2*stride/2 + x/2;
+		for (int j=0; j<8; j++) {
+			memcpy(p + j*stride/2, R + 192 + c*64 + j*8, 8);
+		}
+	}
+}
+
+// SAD of a 16x16 macroblock against pixels with the given stride
+static int jo_SAD16(const unsigned char *a, const unsigned char *b, int stride)
+{
+	int sad = 0;
+#ifdef __SSE2__
+	__m128i s = _mm_setzero_si128();
+	for (int j=0; j<16; j++) {
+		s = _mm_add_epi64(s, _mm_sad_epu8(_mm_loadu_si128((const __m128i*)(a+j*16)), _mm_loadu_si128((const __m128i*)(b+j*stride))));
+	}
+	sad = _mm_cvtsi128_si32(s) + _mm_cvtsi128_si32(_mm_srli_si128(s, 8));
+#else
+	for (int j=0; j<16; j++) {
+		for (int i=0; i<16; i++) {
+			int d = a[j*16+i] - b[j*stride+i];
+			sad += d < 0 ? -d : d;
+		}
+	}
+#endif
+	return sad;
+}
+
+// vector in half-pels from decoded picture k: full search within e->search pixels, then the half-pels around the best
+static void jo_motionSearch(jo_mpeg_t *e, const unsigned char *src, int k, int x, int y, int v[2])
+{
+	int stride = (e->width+15)/16*16, w = stride-16, h = ((e->height+15)/16-1)*16;
+	const unsigned char *ref = jo_plane(e, k, 0);
+	int r = e->search, bx = 0, by = 0;
+	int best = jo_SAD16(src, ref + y*stride + x, stride) - 64;	// zero vectors are cheaper to code
+	for (int dy = y < r ? -y : -r; dy <= r && y+dy <= h; dy++) {
+		for (int dx = x < r ? -x : -r; dx <= r && x+dx <= w; dx++) {
+			int s = jo_SAD16(src, ref + (y+dy)*stride + x+dx, stride);
+			if (s < best) {
+				best = s;
+				bx = dx;
+				by = dy;
+			}
+		}
+	}
+	v[0] = bx*2;
+	v[1] = by*2;
+
+	unsigned char P[256];
+	for (int i=0; i<9; i++) {
+		int vx = bx*2 + i%3 - 1, vy = by*2 + i/3 - 1;
+		if (i == 4 || 2*x+vx < 0 || 2*x+vx > 2*w || 2*y+vy < 0 || 2*y+vy > 2*h) continue;
+		jo_predict(P, ref, stride, x, y, vx, vy, 16);
+		int s = jo_SAD16(src, P, 16);
+		if (s < best) {
+			best = s;
+			v[0] = vx;
+			v[1] = vy;
+		}
+	}
+}
+
+// best prediction of the macroblock S at (x,y) into P, returns its JO_MB_FWD/JO_MB_BWD flags
+// or JO_MB_INTRA when the macroblock differs less from its own mean than from the prediction
+static int jo_motionMode(jo_mpeg_t *e, const float S[384], unsigned char P[384], int type, int x, int y, int v[2][2], int flat)
+{
+	unsigned char src[256], B[384], I[384];
+	int sum = 0, dev = 0;
+	for (int i=0; i<256; i++) {
+		src[i] = (unsigned char)(S[i] + 0.5f);
+		sum += src[i];
+	}
+	for (int i=0; i<256; i++) {
+		int d = src[i] - sum/256;
+		dev += d < 0 ? -d : d;
+	}
+
+	// P-pictures predict from the newer anchor
+	int k = type == 2 ? e->bwd : e->fwd;
+	if (e->search) jo_motionSearch(e, src, k, x, y, v[0]);
+	jo_predictMB(e, P, k, x, y, v[0], flat);
+	int mode = JO_MB_FWD, sad = jo_SAD16(src, P, 16);
+
+	if (type == 3) {
+		if (e->search) jo_motionSearch(e, src, e->bwd, x, y, v[1]);
+		jo_predictMB(e, B, e->bwd, x, y, v[1], flat);
+		for (int i=0; i<384; i++) {
+			I[i] = (P[i] + B[i] + 1) >> 1;
+		}
+		int sb = jo_SAD16(src, B, 16), si = jo_SAD16(src, I, 16);
+		if (si <= sad && si <= sb) {
+			memcpy(P, I, 384);
+			mode |= JO_MB_BWD;
+			sad = si;
+		} else if (sb < sad) {
+			memcpy(P, B, 384);
+			mode = JO_MB_BWD;
+			sad = sb;
+		}
+	}
+	if (!(mode & JO_MB_FWD)) v[0][0] = v[0][1] = 0;
+	if (!(mode & JO_MB_BWD)) v[1][0] = v[1][1] = 0;
+	return dev + 256 < sad ? JO_MB_INTRA : mode;
+}
+
+// block k of the macroblock S less the prediction P, returns the SAD of the two
+static int jo_residual(float A[64], const float S[384], const unsigned char P[384], int k)
+{
+	int stride, off = jo_blockOffset(k, &stride), sad = 0;
+	for (int i=0; i<64; i++) {
+		int j = off + (i>>3)*stride + (i&7);
+		A[i] = S[j] - P[j];
+		int d = (int)(S[j] + 0.5f) - P[j];
+		sad += d < 0 ? -d : d;
+	}
+	return sad;
+}
+
+// decoded block k into R, added to the prediction P unless NULL
+static void jo_reconBlock(unsigned char R[384], const unsigned char *P, int k, const float out[64])
+{
+	int stride, off = jo_blockOffset(k, &stride);
+	for (int i=0; i<64; i++) {
+		int j = off + (i>>3)*stride + (i&7);
+		int v = (int)floorf(out[i] + 0.5f) + (P ? P[j] : 0);
+		R[j] = v < 0 ? 0 : v > 255 ? 255 : v;
+	}
+}
+
+// n pixels of a line to Y and full size Cb, Cr, the last one repeated up to pad;
+// inlined into each width below, four pixels at a time with the very same roundings
+static inline __attribute__((always_inline)) void jo_lineKernel(float *Y, float *CBx, float *CRx, const unsigned char *c, int n, int pad, int mono)
+{
+	int x = 0;
+#ifdef __SSE2__
+	const __m128 ky = _mm_set1_ps(219.f/255), kc = _mm_set1_ps(224.f/255), k16 = _mm_set1_ps(16), k128 = _mm_set1_ps(128);
+	for (; x+4 <= n; x+=4) {
+		const unsigned char *p = c + x*3;
+		__m128 r = _mm_cvtepi32_ps(_mm_setr_epi32(p[0], p[3], p[6], p[9]));
+		__m128 g = _mm_cvtepi32_ps(_mm_setr_epi32(p[1], p[4], p[7], p[10]));
+		__m128 b = _mm_cvtepi32_ps(_mm_setr_epi32(p[2], p[5], p[8], p[11]));
+		__m128 v = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(0.59f), r), _mm_mul_ps(_mm_set1_ps(0.30f), g)), _mm_mul_ps(_mm_set1_ps(0.11f), b));
+		_mm_storeu_ps(Y+x, _mm_add_ps(_mm_mul_ps(v, ky), k16));
+		if (mono) continue;
+		v = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(_mm_set1_ps(-0.17f), r), _mm_mul_ps(_mm_set1_ps(0.33f), g)), _mm_mul_ps(_mm_set1_ps(0.50f), b));
+		_mm_storeu_ps(CBx+x, _mm_add_ps(_mm_mul_ps(v, kc), k128));
+		v = _mm_sub_ps(_mm_sub_ps(_mm_mul_ps(_mm_set1_ps(0.50f), r), _mm_mul_ps(_mm_set1_ps(0.42f), g)), _mm_mul_ps(_mm_set1_ps(0.08f), b));
+		_mm_storeu_ps(CRx+x, _mm_add_ps(_mm_mul_ps(v, kc), k128));
+	}
+#endif
+	for (const unsigned char *p = c + x*3; x<n; x++, p+=3) {
+		float r = p[0], g = p[1], b = p[2];
+		Y[x] = (0.59f*r + 0.30f*g + 0.11f*b) * (219.f/255) + 16;
+		if (mono) continue;
+		CBx[x] = (-0.17f*r - 0.33f*g + 0.50f*b) * (224.f/255) + 128;
+		CRx[x] = (0.50f*r - 0.42f*g - 0.08f*b) * (224.f/255) + 128;
+	}
+	for (x=n; x<pad; x++) {
+		Y[x] = Y[n-1];
+		if (mono) continue;
+		CBx[x] = CBx[n-1];
+		CRx[x] = CRx[n-1];
+	}
+}
+
+typedef void (*jo_line_t)(float *Y, float *CBx, float *CRx, const unsigned char *c, int n, int pad, int mono);
+
+static void jo_lineAny(float *Y, float *CBx, float *CRx, const unsigned char *c, int n, int pad, int mono)
+{
+	jo_lineKernel(Y, CBx, CRx, c, n, pad, mono);
+}
+
+// the common widths with constant trip counts, unrolled and vectorized by the compiler
+#define JO_LINE(w) \
+static void jo_line##w(float *Y, float *CBx, float *CRx, const unsigned char *c, int n, int pad, int mono) \
+{ \
+	jo_lineKernel(Y, CBx, CRx, c, w, w, mono); \
+}
+JO_LINE(640)
+JO_LINE(1280)
+JO_LINE(1920)
+JO_LINE(3840)
+
+static jo_line_t jo_lineFor(int width)
+{
+	switch (width) {
+	case 640: return jo_line640;
+	case 1280: return jo_line1280;
+	case 1920: return jo_line1920;
+	case 3840: return jo_line3840;
+	}
+	return jo_lineAny;
+}
+
+// n pixels from column x0 of macroblock row vblock into planar Y, Cb and Cr of pad columns,
+// the last line repeated down to the macroblock edge; prefetches the next row meanwhile
+static void jo_fetchStrip(jo_mpeg_t *e, const unsigned char *rgbx, int vblock, int x0, int n, int pad, float *strip, jo_line_t line)
+{
+	float *Y = strip, *Cb = Y + 16*pad, *Cr = Cb + 4*pad, *CBx = Cr + 4*pad, *CRx = CBx + 2*pad;
+	int width = e->width, height = e->height;
+	for (int j=0; j<16; j++) {
+		int y = vblock*16 + j;
+		y = y >= height ? height-1 : y;
+		const unsigned char *c = rgbx + (y*width + x0)*3;
+		if (y+16 < height) {
+			for (int i=0; i<n*3; i+=64) __builtin_prefetch(c + 16*width*3 + i);
+		}
+		line(Y + j*pad, CBx + (j&1)*pad, CRx + (j&1)*pad, c, n, pad, e->mono);
+		if (e->mono || !(j&1)) continue;
+
+		// Downsample Cb,Cr (420 format)
+		int half = pad >> 1, i = 0;
+		float *cb = Cb + (j>>1)*half, *cr = Cr + (j>>1)*half;
+#ifdef __SSE2__
+		const __m128 q = _mm_set1_ps(0.25f);
+		for (; i<half; i+=4) {
+			__m128 a0 = _mm_loadu_ps(CBx + 2*i), a1 = _mm_loadu_ps(CBx + 2*i + 4);
+			__m128 b0 = _mm_loadu_ps(CBx + pad + 2*i), b1 = _mm_loadu_ps(CBx + pad + 2*i + 4);
+			__m128 v = _mm_add_ps(_mm_shuffle_ps(a0, a1, 0x88), _mm_shuffle_ps(a0, a1, 0xdd));
+			v = _mm_add_ps(_mm_add_ps(v, _mm_shuffle_ps(b0, b1, 0x88)), _mm_shuffle_ps(b0, b1, 0xdd));
+			_mm_storeu_ps(cb + i, _mm_mul_ps(v, q));
+			a0 = _mm_loadu_ps(CRx + 2*i), a1 = _mm_loadu_ps(CRx + 2*i + 4);
+			b0 = _mm_loadu_ps(CRx + pad + 2*i), b1 = _mm_loadu_ps(CRx + pad + 2*i + 4);
+			v = _mm_add_ps(_mm_shuffle_ps(a0, a1, 0x88), _mm_shuffle_ps(a0, a1, 0xdd));
+			v = _mm_add_ps(_mm_add_ps(v, _mm_shuffle_ps(b0, b1, 0x88)), _mm_shuffle_ps(b0, b1, 0xdd));
+			_mm_storeu_ps(cr + i, _mm_mul_ps(v, q));
+		}
+#endif
+		for (; i<half; i++) {
+			cb[i] = (CBx[2*i] + CBx[2*i+1] + CBx[pad+2*i] + CBx[pad+2*i+1]) * 0.25f;
+			cr[i] = (CRx[2*i] + CRx[2*i+1] + CRx[pad+2*i] + CRx[pad+2*i+1]) * 0.25f;
+		}
+	}
+}
+
+// Y, Cb, Cr of the macroblock at column x of a strip, flat chroma for grey
+static void jo_fetchMB(const float *strip, int pad, int x, float S[384], int mono)
+{
+	const float *Cb = strip + 16*pad, *Cr = Cb + 4*pad;
+	int half = pad >> 1;
+#ifdef __SSE2__
+	for (int j=0; j<16; j++) {
+		const float *p = strip + j*pad + x;
+		_mm_storeu_ps(S + j*16, _mm_loadu_ps(p));
+		_mm_storeu_ps(S + j*16 + 4, _mm_loadu_ps(p + 4));
+		_mm_storeu_ps(S + j*16 + 8, _mm_loadu_ps(p + 8));
+		_mm_storeu_ps(S + j*16 + 12, _mm_loadu_ps(p + 12));
+	}
+	__m128 c = _mm_set1_ps(128);
+	for (int j=0; j<8; j++) {
+		const float *b = Cb + j*half + (x>>1), *r = Cr + j*half + (x>>1);
+		_mm_storeu_ps(S + 256 + j*8, mono ? c : _mm_loadu_ps(b));
+		_mm_storeu_ps(S + 260 + j*8, mono ? c : _mm_loadu_ps(b + 4));
+		_mm_storeu_ps(S + 320 + j*8, mono ? c : _mm_loadu_ps(r));
+		_mm_storeu_ps(S + 324 + j*8, mono ? c : _mm_loadu_ps(r + 4));
+	}
+#else
+	for (int j=0; j<16; j++) {
+		memcpy(S + j*16, strip + j*pad + x, 16*sizeof(float));
+	}
+	if (mono) {
+		for (int i=256; i<384; i++) S[i] = 128;
+		return;
+	}
+	for (int j=0; j<8; j++) {
+		memcpy(S + 256 + j*8, Cb + j*half + (x>>1), 8*sizeof(float));
+		memcpy(S + 320 + j*8, Cr + j*half + (x>>1), 8*sizeof(float));
+	}
+#endif
+}
+
+// type 1: I-picture that starts a closed GOP, 2: P-picture from the newer anchor, 3: B-picture from both anchors.
+// tref is the display position in the GOP; I- and P-pictures become the newer anchor.
+int jo_mpeg_picture(jo_mpeg_t *e, unsigned char *mem, const unsigned char *rgbx, int type, int tref)
+{
+	int width = e->width, height = e->height;
+	unsigned char *smem = mem, *sent = mem;
+	int lastDCY = 128, lastDCCR = 128, lastDCCB = 128;
+	jo_bits_t bits = {&mem};
+	int mbw = (width+15)/16;
+	int fcode = jo_fcode(e->search);
+	int cur = 3 - e->fwd - e->bwd;	// decoded picture in e->ref
+	int anchor = e->ref && type != 3;
+	// grey predicted from grey anchors leaves nothing to code in chroma
+	int flat = e->mono && (type == 1 || (e->grey[e->bwd] && (type == 2 || e->grey[e->fwd])));
+	int blocks = flat ? 4 : 6;	// coded ones
+	int pad = mbw*16;
+	jo_line_t line = jo_lineFor(width);
+
+	if (type == 1) {
+		// Sequence Header
+		put4b("\x00\x00\x01\xB3", &mem);
+		jo_writeBits(&bits, width, 12);
+		jo_writeBits(&bits, height, 12);
+		jo_writeBits(&bits, 1, 4); // aspect ratio
+		jo_writeBits(&bits, e->rate, 4);
+		jo_writeBits(&bits, 0xFFFF, 16); // bit_rate, variable
+		jo_writeBits(&bits, 3, 2);
+		jo_writeBits(&bits, 1, 1); // marker
+		jo_writeBits(&bits, 20, 10); // vbv_buffer_size
+		jo_writeBits(&bits, 0, 1); // constrained_parameters_flag
+		jo_writeBits(&bits, e->loadMatrix, 1);
+		if (e->loadMatrix) {
+			unsigned char zz[64];
+			for (int i=0; i<64; i++) {
+				zz[s_jo_ZigZag[i]] = e->intraMatrix[i];
+			}
+			for (int i=0; i<64; i++) {
+				jo_writeBits(&bits, zz[i], 8);
+			}
+		}
+		jo_writeBits(&bits, 0, 1); // load_non_intra_quantizer_matrix
+
+		// GOP header, time code of the first picture
+		int fps = (s_jo_frameRate[e->rate][0] + s_jo_frameRate[e->rate][1]-1) / s_jo_frameRate[e->rate][1];
+		int sec = e->frame / fps;
+		put4b("\x00\x00\x01\xB8", &mem);
+		jo_writeBits(&bits, (sec/3600) % 24, 6); // drop_frame_flag 0, hours
+		jo_writeBits(&bits, (sec/60) % 60, 6);
+		jo_writeBits(&bits, 1, 1); // marker
+		jo_writeBits(&bits, sec % 60, 6);
+		jo_writeBits(&bits, e->frame % fps, 6);
+		jo_writeBits(&bits, 0x40, 7); // closed_gop, broken_link 0
+		e->tref = tref = 0;
+	}
+	e->tref = tref > e->tref ? tref : e->tref;
+	e->type = type;
+	e->pcount = type == 1 ? 0 : e->pcount + (type == 2);
+	jo_pictureHeader(&bits, tref, type, fcode);
 
 	for (int vblock=0; vblock<(height+15)/16; vblock++) {
-		for (int hblock=0; hblock<(width+15)/16; hblock++) {
-			jo_writeBits(&bits, 3, 2);
-
-			float Y[256], CBx[256], CRx[256];
-			for (int i=0; i<256; ++i) {
-				int y = vblock*16+(i/16);
-				int x = hblock*16+(i&15);
-				x = x >= width ? width-1 : x;
-				y = y >= height ? height-1 : y;
-				//const unsigned char *c = rgbx + y*width*4+x*4;
-				const unsigned char *c = rgbx + y*width*3+x*3;
-				float r = c[0], g = c[1], b = c[2];
-				Y[i] = (0.59f*r + 0.30f*g + 0.11f*b) * (219.f/255) + 16;
-				CBx[i] = (-0.17f*r - 0.33f*g + 0.50f*b) * (224.f/255) + 128;
-				CRx[i] = (0.50f*r - 0.42f*g - 0.08f*b) * (224.f/255) + 128;
+		// one slice per macroblock row, DC and vector predictors start over
+		put1b(0, &mem); // Slice header
+		put1b(0, &mem);
+		put1b(1, &mem);
+		put1b(vblock+1, &mem);
+		jo_writeBits(&bits, e->qscale<<1, 6);
+		lastDCY = lastDCCR = lastDCCB = 128;
+		int skipped = 0, curQ = e->qscale, lastIntra = 1;
+		int pmv[2][2] = {{0}};		// vector predictors
+		// the rows take turns, spread over JO_MPEG_REFRESH P-pictures
+		int refresh = type == 2 && vblock * JO_MPEG_REFRESH / ((height+15)/16) == e->pcount % JO_MPEG_REFRESH;
+		int mode = 0, mv[2][2] = {{0}};	// of the last non-intra macroblock, 0: none
+		if (e->strip) {
+			jo_fetchStrip(e, rgbx, vblock, 0, width, pad, e->strip, line);
+		}
+
+		for (int hblock=0; hblock<mbw; hblock++) {
+			// Y, Cb, Cr of the macroblock
+			float S[384];
+			if (e->strip) {
+				jo_fetchMB(e->strip, pad, hblock*16, S, e->mono);
+			} else {
+				float strip[16*28];
+				int x = hblock*16;
+				jo_fetchStrip(e, rgbx, vblock, x, width-x < 16 ? width-x : 16, 16, strip, jo_lineAny);
+				jo_fetchMB(strip, 16, 0, S, e->mono);
+			}
+
+			// busy areas hide more quantization noise than flat ones
+			int q = e->qscale;
+			if (e->aq) {
+				float act = jo_activity(S);
+				e->sumAct += act;
+				if (e->avgAct > 0) {
+					q = (int)(e->qscale * (2*act + e->avgAct) / (act + 2*e->avgAct) + 0.5f);
+					q = q < 1 ? 1 : q > 31 ? 31 : q;
+				}
+			}
+			// the background is coarse and lets more change go uncoded
+			int skipLevel = e->skipLevel;
+			if (e->bgQ && (hblock < e->roi[0] || vblock < e->roi[1] || hblock >= e->roi[2] || vblock >= e->roi[3])) {
+				q = e->bgQ;
+				skipLevel = 64 + 16*q;
+			}
+
+			unsigned char P[384], R[384];
+			int Q[6][64], cbp = 0, flags = JO_MB_INTRA;
+			int v[2][2] = {{0}};
+			if (type != 1 && !refresh) {
+				flags = jo_motionMode(e, S, P, type, hblock*16, vblock*16, v, flat);
+			}
+			// a still needs the DCT of the source, non-intra macroblocks only have that of the residual
+			float *snap = e->snap ? e->snap + (vblock*mbw + hblock)*384 : 0;
+			if (snap && !(flags & JO_MB_INTRA)) {
+				for (int k=0; k<6; k++) {
+					int stride, off = jo_blockOffset(k, &stride);
+					for (int i=0; i<64; i+=8) {
+						memcpy(snap + k*64 + i, S + off + (i>>3)*stride, 8*sizeof(S[0]));
+					}
+					jo_fdct(snap + k*64);
+				}
+			}
+			if (!(flags & JO_MB_INTRA)) {
+				// blocks that differ by no more than noise stay uncoded
+				for (int k=0; k<blocks; k++) {
+					float A[64];
+					if (jo_residual(A, S, P, k) <= skipLevel) continue;
+					jo_fdct(A);
+					jo_quantize(A, e->interTbl[q], Q[k], 0);
+					for (int i=0; i<64; i++) {
+						if (Q[k][i]) {
+							cbp |= 32 >> k;
+							break;
+						}
+					}
+				}
+				if (cbp) flags |= JO_MB_PAT;
 			}
 
-			// Downsample Cb,Cr (420 format)
-			float CB[64], CR[64];
-			for (int i=0; i<64; ++i) {
-				int j =(i&7)*2 + (i&56)*4;
-				CB[i] = (CBx[j] + CBx[j+1] + CBx[j+16] + CBx[j+17]) * 0.25f;
-				CR[i] = (CRx[j] + CRx[j+1] + CRx[j+16] + CRx[j+17]) * 0.25f;
+			// a slice starts and ends with a coded macroblock, a skipped one repeats
+			// the vector 0 in P-pictures and the last prediction in B-pictures
+			if (!(flags & JO_MB_INTRA) && !cbp && hblock && hblock < mbw-1
+				&& (type == 2 ? !v[0][0] && !v[0][1] : flags == mode && !memcmp(v, mv, sizeof(mv)))) {
+				if (anchor) jo_storeMB(e, cur, hblock*16, vblock*16, P);
+				if (type == 2) memset(pmv, 0, sizeof(pmv));
+				lastIntra = 0;
+				skipped++;
+				continue;
 			}
+			jo_macroblockAddress(&bits, skipped+1);
+			skipped = 0;
 
-			for (int k1=0; k1<2; ++k1) {
-				for (int k2=0; k2<2; ++k2) {
+			if (type == 2 && cbp && !v[0][0] && !v[0][1]) {
+				flags &= ~JO_MB_FWD;	// no motion compensation
+			}
+			if ((flags & (JO_MB_INTRA|JO_MB_PAT)) && q != curQ) {
+				flags |= JO_MB_QUANT;
+			}
+			if (type == 1) {
+				jo_writeBits(&bits, 1, flags & JO_MB_QUANT ? 2 : 1); // intra-q, intra-d
+			} else {
+				jo_writeBits(&bits, s_jo_HTMBT[type-2][flags][0], s_jo_HTMBT[type-2][flags][1]);
+			}
+			if (flags & JO_MB_QUANT) {
+				jo_writeBits(&bits, q, 5);
+				curQ = q;
+			}
+
+			if (flags & JO_MB_INTRA) {
+				if (!lastIntra) {
+					lastDCY = lastDCCR = lastDCCB = 128;
+				}
+				lastIntra = 1;
+				memset(pmv, 0, sizeof(pmv));
+				mode = 0;
+
+				for (int k=0; k<(e->mono ? 4 : 6); k++) {
 					float block[64];
+					int stride, off = jo_blockOffset(k, &stride);
 					for (int i=0; i<64; i+=8) {
-						int j = (i&7)+(i&56)*2 + k1*8*16 + k2*8;
-						memcpy(block+i, Y+j, 8*sizeof(Y[0]));
+						memcpy(block+i, S + off + (i>>3)*stride, 8*sizeof(S[0]));
+					}
+					if (k < 4) {
+						lastDCY = jo_processDU(&bits, block, e->quantTbl[q], s_jo_HTDC_Y, lastDCY, Q[k]);
+					} else if (k == 4) {
+						lastDCCB = jo_processDU(&bits, block, e->quantTbl[q], s_jo_HTDC_C, lastDCCB, Q[k]);
+					} else {
+						lastDCCR = jo_processDU(&bits, block, e->quantTbl[q], s_jo_HTDC_C, lastDCCR, Q[k]);
+					}
+					if (snap) memcpy(snap + k*64, block, sizeof(block));
+					if (anchor) {
+						jo_reconDU(Q[k], q, e->intraMatrix, block);
+						jo_reconBlock(R, 0, k, block);
+					}
+				}
+				if (e->mono) {
+					jo_writeBits(&bits, JO_MPEG_GREY_BITS, JO_MPEG_GREY_SIZE);
+					for (int k=4; k<6 && snap; k++) {
+						for (int i=0; i<64; i++) snap[k*64+i] = 128;
+						jo_fdct(snap + k*64);
+					}
+					if (anchor) memset(R+256, 128, 128);
+				}
+			} else {
+				lastIntra = 0;
+				for (int d=0; d<2; d++) {
+					if (flags & (JO_MB_FWD << d)) {
+						jo_motionVector(&bits, v[d][0], pmv[d][0], fcode);
+						jo_motionVector(&bits, v[d][1], pmv[d][1], fcode);
+						pmv[d][0] = v[d][0];
+						pmv[d][1] = v[d][1];
+					}
+				}
+				if (type == 2 && !(flags & JO_MB_FWD)) {
+					memset(pmv, 0, sizeof(pmv));
+				}
+				mode = flags & (JO_MB_FWD|JO_MB_BWD);
+				memcpy(mv, v, sizeof(mv));
+
+				if (anchor) memcpy(R, P, 384);
+				if (cbp) {
+					jo_writeBits(&bits, s_jo_HTCBP[cbp][0], s_jo_HTCBP[cbp][1]);
+				}
+				for (int k=0; k<6; k++) {
+					if (!(cbp & (32 >> k))) continue;
+					jo_writeAC(&bits, Q[k], 0);
+					if (anchor) {
+						float out[64];
+						jo_reconDU(Q[k], q, 0, out);
+						jo_reconBlock(R, P, k, out);
 					}
-					lastDCY = jo_processDU(&bits, block, s_jo_HTDC_Y, lastDCY);
 				}
 			}
-			lastDCCB = jo_processDU(&bits, CB, s_jo_HTDC_C, lastDCCB);
-			lastDCCR = jo_processDU(&bits, CR, s_jo_HTDC_C, lastDCCR);
+			if (anchor) jo_storeMB(e, cur, hblock*16, vblock*16, R);
+		}
+		jo_flushBits(&bits);
+		if (e->slice) {
+			// the first one with the headers before it
+			e->slice(e->sliceArg, sent, mem - sent);
+			sent = mem;
 		}
 	}
-	jo_writeBits(&bits, 0, 7);
-	put4b("\x00\x00\x01\xb7", &mem); // End of Sequence
+	if (anchor) {
+		e->grey[cur] = flat;
+		e->fwd = e->bwd;
+		e->bwd = cur;
+	}
+	if (e->aq) {
+		e->avgAct = e->sumAct / (mbw * ((height+15)/16));
+		e->sumAct = 0;
+	}
+	e->frame++;
 	return mem-smem;
 }
 
+// I-picture at GOP boundaries, scene cuts and where grey follows colour, otherwise a P-picture
+// that skips unchanged macroblocks
+int jo_mpeg_encode(jo_mpeg_t *e, unsigned char *mem, const unsigned char *rgbx, int cut)
+{
+	int dist = e->tref + 1;	// pictures since the last I-picture
+	int intra = !e->ref || !e->type || dist >= e->gopMax || dist >= 900 || (cut && dist >= e->gopMin)
+		|| (e->mono && !e->grey[e->bwd]);
+	return jo_mpeg_picture(e, mem, rgbx, intra ? 1 : 2, dist);
+}
+
+// JPEG bits, a 0xFF byte is followed by a 0
+static void jo_jpegBits(jo_bits_t *b, int value, int count)
+{
+	b->cnt += count;
+	b->buf |= value << (24 - b->cnt);
+	while (b->cnt >= 8) {
+		unsigned char c = (b->buf >> 16) & 255;
+		put1b(c, b->p);
+		if (c == 255) put1b(0, b->p);
+		b->buf <<= 8;
+		b->cnt -= 8;
+	}
+}
+
+// size category and its bits of a coefficient
+static void jo_jpegValue(jo_bits_t *b, const unsigned short ht[256][2], int run, int v)
+{
+	int a = v < 0 ? -v : v, size = 0;
+	while (a >> size) size++;
+	jo_jpegBits(b, ht[run<<4 | size][0], ht[run<<4 | size][1]);
+	if (size) jo_jpegBits(b, (v < 0 ? v-1 : v) & ((1<<size)-1), size);
+}
+
+static void jo_jpegBlock(jo_bits_t *b, const int Q[64], int *dc, const unsigned short htdc[256][2], const unsigned short htac[256][2])
+{
+	jo_jpegValue(b, htdc, 0, Q[0] - *dc);
+	*dc = Q[0];
+	int end = 63;
+	while (end > 0 && !Q[end]) end--;
+	for (int i=1, run=0; i<=end; i++) {
+		if (!Q[i]) {
+			run++;
+			continue;
+		}
+		for (; run >= 16; run -= 16) {
+			jo_jpegBits(b, htac[0xf0][0], htac[0xf0][1]);	// ZRL
+		}
+		jo_jpegValue(b, htac, run, Q[i]);
+		run = 0;
+	}
+	if (end < 63) jo_jpegBits(b, htac[0][0], htac[0][1]);	// EOB
+}
+
+static void jo_jpegMarker(unsigned char **p, int marker, int len)
+{
+	put1b(0xff, p);
+	put1b(marker, p);
+	put1b(len >> 8, p);
+	put1b(len & 255, p);
+}
+
+// baseline JFIF of the last picture coded while e->snap was set, quality 1..100 as libjpeg
+int jo_mpeg_jpeg(jo_mpeg_t *e, unsigned char *mem, int quality)
+{
+	unsigned char *smem = mem;
+	int mbw = (e->width+15)/16, mbh = (e->height+15)/16;
+	int scale = quality < 1 ? 5000 : quality < 50 ? 5000/quality : quality > 100 ? 0 : 200 - 2*quality;
+	unsigned char qt[2][64];
+	float tbl[2][64], dcOff[2];
+	unsigned short ht[4][256][2];
+
+	for (int c=0; c<2; c++) {
+		// JFIF is full range, MPEG has Y in 16..235 and Cb, Cr in 16..240
+		float k = c ? 255.f/224 : 255.f/219;
+		for (int i=0; i<64; i++) {
+			int v = (s_jo_jpegQuant[c][i] * scale + 50) / 100;
+			v = v < 1 ? 1 : v > 255 ? 255 : v;
+			qt[c][s_jo_ZigZag[i]] = v;
+			tbl[c][i] = k / (v * s_jo_aasf[i>>3] * s_jo_aasf[i&7]);
+		}
+		// the DC of the MPEG blocks is 8 times the mean, JPEG levels are around 0
+		dcOff[c] = (c ? 8*128*k : 8*(16*k + 128)) / qt[c][0];
+	}
+	for (int t=0; t<4; t++) {
+		const unsigned char *val = t&1 ? s_jo_jpegAC[t>>1] : s_jo_jpegDC;
+		int code = 0, n = 0;
+		memset(ht[t], 0, sizeof(ht[t]));
+		for (int len=1; len<=16; len++, code<<=1) {
+			for (int i=0; i<s_jo_jpegBits[t][len-1]; i++, n++) {
+				ht[t][val[n]][0] = code++;
+				ht[t][val[n]][1] = len;
+			}
+		}
+	}
+
+	put1b(0xff, &mem);
+	put1b(0xd8, &mem);	// SOI
+	static const unsigned char jfif[] = { 'J','F','I','F',0, 1,1, 0, 0,1, 0,1, 0,0 };
+	jo_jpegMarker(&mem, 0xe0, 2+sizeof(jfif));
+	memcpy(mem, jfif, sizeof(jfif));
+	mem += sizeof(jfif);
+	jo_jpegMarker(&mem, 0xdb, 2+2*65);	// DQT
+	for (int c=0; c<2; c++) {
+		put1b(c, &mem);
+		memcpy(mem, qt[c], 64);
+		mem += 64;
+	}
+	jo_jpegMarker(&mem, 0xc0, 17);	// SOF0, Y 2x2, Cb and Cr 1x1
+	put1b(8, &mem);
+	put1b(e->height >> 8, &mem);
+	put1b(e->height & 255, &mem);
+	put1b(e->width >> 8, &mem);
+	put1b(e->width & 255, &mem);
+	put1b(3, &mem);
+	for (int c=1; c<=3; c++) {
+		put1b(c, &mem);
+		put1b(c == 1 ? 0x22 : 0x11, &mem);
+		put1b(c > 1, &mem);
+	}
+	jo_jpegMarker(&mem, 0xc4, 2 + 4*17 + 2*12 + 2*162);	// DHT
+	for (int t=0; t<4; t++) {
+		put1b((t&1)<<4 | t>>1, &mem);
+		memcpy(mem, s_jo_jpegBits[t], 16);
+		mem += 16;
+		int n = t&1 ? 162 : 12;
+		memcpy(mem, t&1 ? s_jo_jpegAC[t>>1] : s_jo_jpegDC, n);
+		mem += n;
+	}
+	jo_jpegMarker(&mem, 0xda, 12);	// SOS
+	put1b(3, &mem);
+	for (int c=1; c<=3; c++) {
+		put1b(c, &mem);
+		put1b(c > 1 ? 0x11 : 0, &mem);
+	}
+	put1b(0, &mem);
+	put1b(63, &mem);
+	put1b(0, &mem);
+
+	// a macroblock is an MCU, the same four Y, Cb and Cr blocks
+	jo_bits_t bits = {&mem};
+	int dc[3] = {0};
+	for (int m=0; m<mbw*mbh; m++) {
+		for (int k=0; k<6; k++) {
+			const float *A = e->snap + m*384 + k*64;
+			int c = k >= 4, Q[64];
+			for (int i=0; i<64; i++) {
+				float v = A[i]*tbl[c][i] - (i ? 0 : dcOff[c]);
+				int l = (int)(v < 0 ? ceilf(v - 0.5f) : floorf(v + 0.5f));
+				l = l < -1023 ? -1023 : l > 1023 ? 1023 : l;
+				Q[s_jo_ZigZag[i]] = l;
+			}
+			jo_jpegBlock(&bits, Q, &dc[k < 4 ? 0 : k-3], ht[c*2], ht[c*2+1]);
+		}
+	}
+	jo_jpegBits(&bits, 0x7f, 7);	// fill with 1 bits
+	put1b(0xff, &mem);
+	put1b(0xd9, &mem);	// EOI
+	return mem-smem;
+}
+
+// a complete sequence with a single picture
+int encode_mpeg(unsigned char *mem, const unsigned char *rgbx, int width, int height, int fps)
+{
+	jo_mpeg_t e;
+	jo_mpeg_init(&e, width, height, fps, 8);
+	int s = jo_mpeg_encode(&e, mem, rgbx, 0);
+	return s + jo_mpeg_end(&e, mem+s);
+}
+
 #include <stdlib.h>
 void jo_write_mpeg(FILE *fp, const unsigned char *rgbx, int width, int height, int fps)
 {
-	unsigned char *mem = (unsigned char *)malloc(width*height*3);
+	unsigned char *mem = (unsigned char *)malloc(JO_MPEG_MAXSIZE(width, height));
 	//unsigned char *mem = calloc(1, width*height*3);
 	int s = encode_mpeg(mem, rgbx, width, height, fps);
 	fwrite(mem, s, 1, fp);
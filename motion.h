@@ -0,0 +1,224 @@
+//---------------------------------------------------------
+//	Catlive
+//
+//		©2017 Yuichiro Nakada
+//---------------------------------------------------------
+
+// Motion detection on the luma of YUYV frames and the pre-roll ring
+// that keeps already encoded frames until motion starts.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define MOTION_CELL	16	// grid cell size in pixels
+
+typedef struct {
+	int level;		// luma difference of a cell to count as changed, 0: off
+	int cells;		// changed cells needed to trigger
+	int gw, gh;		// grid size
+	unsigned char *grid;	// mean luma per cell, current frame
+	unsigned char *prev;	// mean luma per cell, previous frame
+	int first;
+} MOTION_OBJ;
+
+static void motion_init(MOTION_OBJ *m, int width, int height, int level)
+{
+	m->level = level;
+	m->gw = width / MOTION_CELL;
+	m->gh = height / MOTION_CELL;
+	m->cells = m->gw*m->gh / 200 + 1;	// 0.5% of the picture
+	m->grid = (unsigned char*)calloc(2, ((m->gw*m->gh + 15) & ~15));
+	if (!m->grid) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	m->prev = m->grid + ((m->gw*m->gh + 15) & ~15);
+	m->first = 1;
+}
+
+static void motion_free(MOTION_OBJ *m)
+{
+	// motion_grid() swaps the halves
+	free(m->grid < m->prev ? m->grid : m->prev);
+	m->grid = m->prev = 0;
+}
+
+// sum of 16 luma samples from 32 bytes of YUYV
+static inline int motion_sum16(const unsigned char *p)
+{
+#ifdef __SSE2__
+	const __m128i mask = _mm_set1_epi16(0x00ff);
+	__m128i a = _mm_and_si128(_mm_loadu_si128((const __m128i*)p), mask);
+	__m128i b = _mm_and_si128(_mm_loadu_si128((const __m128i*)(p+16)), mask);
+	__m128i s = _mm_add_epi64(_mm_sad_epu8(a, _mm_setzero_si128()), _mm_sad_epu8(b, _mm_setzero_si128()));
+	return _mm_cvtsi128_si32(s) + _mm_cvtsi128_si32(_mm_srli_si128(s, 8));
+#else
+	int s = 0;
+	for (int i=0; i<32; i+=2) s += p[i];
+	return s;
+#endif
+}
+
+// sum of absolute differences of two grids
+static int motion_sad(const unsigned char *a, const unsigned char *b, int n)
+{
+	int sad = 0, i = 0;
+#ifdef __SSE2__
+	for (; i+16<=n; i+=16) {
+		__m128i s = _mm_sad_epu8(_mm_loadu_si128((const __m128i*)(a+i)), _mm_loadu_si128((const __m128i*)(b+i)));
+		sad += _mm_cvtsi128_si32(s) + _mm_cvtsi128_si32(_mm_srli_si128(s, 8));
+	}
+#endif
+	for (; i<n; i++) {
+		int d = a[i] - b[i];
+		sad += d < 0 ? -d : d;
+	}
+	return sad;
+}
+
+// count grid cells differing by more than level
+static int motion_diff(const unsigned char *a, const unsigned char *b, int n, int level)
+{
+	int count = 0, i = 0;
+#ifdef __SSE2__
+	const __m128i t = _mm_set1_epi8((char)level);
+	for (; i+16<=n; i+=16) {
+		__m128i x = _mm_loadu_si128((const __m128i*)(a+i));
+		__m128i y = _mm_loadu_si128((const __m128i*)(b+i));
+		__m128i d = _mm_or_si128(_mm_subs_epu8(x, y), _mm_subs_epu8(y, x));
+		// lanes with d > level
+		__m128i over = _mm_cmpeq_epi8(_mm_subs_epu8(d, t), _mm_setzero_si128());
+		count += 16 - __builtin_popcount(_mm_movemask_epi8(over));
+	}
+#endif
+	for (; i<n; i++) {
+		int d = a[i] - b[i];
+		count += (d < 0 ? -d : d) > level;
+	}
+	return count;
+}
+
+// downscale the luma of a new frame, the last grid becomes prev
+static void motion_grid(MOTION_OBJ *m, const unsigned char *yuyv, int width)
+{
+	unsigned char *t = m->prev;
+	m->prev = m->grid;
+	m->grid = t;
+
+	for (int gy=0; gy<m->gh; gy++) {
+		unsigned char *g = m->grid + gy*m->gw;
+		int sum[m->gw];
+		memset(sum, 0, sizeof(sum));
+		for (int y=0; y<MOTION_CELL; y++) {
+			const unsigned char *p = yuyv + (gy*MOTION_CELL+y)*width*2;
+			for (int gx=0; gx<m->gw; gx++) {
+				sum[gx] += motion_sum16(p + gx*MOTION_CELL*2);
+			}
+		}
+		for (int gx=0; gx<m->gw; gx++) {
+			g[gx] = sum[gx] / (MOTION_CELL*MOTION_CELL);
+		}
+	}
+	if (m->first) {
+		m->first = 0;
+		memcpy(m->prev, m->grid, m->gw*m->gh);
+	}
+}
+
+// return 1 when the last grid moved against the previous one
+static int motion_detect(MOTION_OBJ *m)
+{
+	return motion_diff(m->grid, m->prev, m->gw*m->gh, m->level) >= m->cells;
+}
+
+
+// Pre-roll: a preallocated ring of encoded frames
+typedef struct {
+	unsigned char *mem;
+	int size;		// bytes in mem
+	int *off, *len;		// placement of each frame
+	int *type;		// picture type, an I-picture can start the output
+	long long *time;	// capture time of each frame
+	int frames, first, n;	// capacity, index of the oldest, number of frames
+} PREROLL_OBJ;
+
+static void preroll_init(PREROLL_OBJ *r, int frames, int size)
+{
+	memset(r, 0, sizeof(PREROLL_OBJ));
+	if (frames <= 0) return;
+	r->frames = frames;
+	r->size = size;
+	r->mem = (unsigned char*)rt_alloc(size);
+	r->off = (int*)calloc(frames*3, sizeof(int));
+	r->time = (long long*)calloc(frames, sizeof(long long));
+	if (!r->mem || !r->off || !r->time) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	r->len = r->off + frames;
+	r->type = r->len + frames;
+}
+
+static void preroll_free(PREROLL_OBJ *r)
+{
+	rt_free(r->mem);
+	free(r->off);
+	free(r->time);
+	memset(r, 0, sizeof(PREROLL_OBJ));
+}
+
+// offset where a frame of len bytes fits, or -1
+static int preroll_fit(PREROLL_OBJ *r, int len)
+{
+	if (!r->n) return 0;
+	int last = (r->first + r->n - 1) % r->frames;
+	int head = r->off[last] + r->len[last];
+	int tail = r->off[r->first];
+	if (head > tail) {
+		// not wrapped, the end of mem may stay unused
+		if (r->size - head >= len) return head;
+		return tail >= len ? 0 : -1;
+	}
+	return tail - head >= len ? head : -1;
+}
+
+static void preroll_push(PREROLL_OBJ *r, const unsigned char *p, int len, int type, long long time)
+{
+	int pos;
+	if (!r->frames || len > r->size) return;
+	while (r->n == r->frames || (pos = preroll_fit(r, len)) < 0) {
+		// drop the oldest frame
+		r->first = (r->first + 1) % r->frames;
+		r->n--;
+	}
+
+	int i = (r->first + r->n) % r->frames;
+	memcpy(r->mem + pos, p, len);
+	r->off[i] = pos;
+	r->len[i] = len;
+	r->type[i] = type;
+	r->time[i] = time;
+	r->n++;
+}
+
+// write all kept frames from the oldest I-picture on at *offset of fp and empty the ring,
+// return the frames written
+static int preroll_flush(PREROLL_OBJ *r, FILE *fp, long long *offset, MPGINDEX_WRITER *idx)
+{
+	int skip = 1, n = 0;
+	for (; r->n; r->n--) {
+		skip = skip && r->type[r->first] != 1;
+		if (!skip) {
+			fwrite(r->mem + r->off[r->first], r->len[r->first], 1, fp);
+			mpgindex_add(idx, r->time[r->first], *offset, r->len[r->first], r->type[r->first]);
+			*offset += r->len[r->first];
+			n++;
+		}
+		r->first = (r->first + 1) % r->frames;
+	}
+	return n;
+}
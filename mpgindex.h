@@ -0,0 +1,172 @@
+//---------------------------------------------------------
+//	Catlive
+//
+//		©2017 Yuichiro Nakada
+//---------------------------------------------------------
+
+// Frame index of a recording (cam2mpg -I): file.mpg.idx holds one entry per
+// picture in file order, appended in batches and read memory mapped.
+// Pictures of archive mode are coded out of display order, but nothing crosses
+// an I-picture, so a binary search on the time still finds the right one.
+//
+//	MPGINDEX x;
+//	if (mpgindex_open(&x, "cam.mpg.idx")) perror("index");
+//	long i = mpgindex_find(&x, time);	// I-picture to start at, -1: none
+//	if (i >= 0) fseek(mpg, x.e[i].offset, SEEK_SET);
+//	mpgindex_close(&x);
+
+#ifndef MPGINDEX_H
+#define MPGINDEX_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define MPGINDEX_MAGIC	0x3169706d	// "mpi1"
+#define MPGINDEX_BATCH	64		// entries written at once
+
+typedef struct {
+	uint32_t magic;
+	uint32_t entrySize;	// sizeof(MPGINDEX_ENTRY)
+	uint64_t reserved;
+} MPGINDEX_HEADER;
+
+typedef struct {
+	int64_t time;		// capture time in usec since the epoch
+	uint64_t offset;	// of the picture in the recording
+	uint32_t size;		// bytes, an I-picture with its sequence header
+	uint32_t type;		// 1: I, 2: P, 3: B
+} MPGINDEX_ENTRY;
+
+typedef struct {
+	const MPGINDEX_ENTRY *e;
+	long n;
+	void *map;
+	size_t size;
+} MPGINDEX;
+
+// map an index, -1 and errno on error
+static inline int mpgindex_open(MPGINDEX *x, const char *path)
+{
+	memset(x, 0, sizeof(MPGINDEX));
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return -1;
+	struct stat st;
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(MPGINDEX_HEADER)) {
+		close(fd);
+		errno = EPROTO;
+		return -1;
+	}
+	x->size = st.st_size;
+	x->map = mmap(NULL, x->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (x->map == MAP_FAILED) return -1;
+	const MPGINDEX_HEADER *h = (const MPGINDEX_HEADER*)x->map;
+	if (h->magic != MPGINDEX_MAGIC || h->entrySize != sizeof(MPGINDEX_ENTRY)) {
+		munmap(x->map, x->size);
+		x->map = 0;
+		errno = EPROTO;
+		return -1;
+	}
+	x->e = (const MPGINDEX_ENTRY*)(h+1);
+	// a batch may be half written while recording
+	x->n = (x->size - sizeof(MPGINDEX_HEADER)) / sizeof(MPGINDEX_ENTRY);
+	return 0;
+}
+
+static inline void mpgindex_close(MPGINDEX *x)
+{
+	if (x->map) munmap(x->map, x->size);
+	x->map = 0;
+}
+
+// the I-picture at or before entry i, -1: none
+static inline long mpgindex_key(const MPGINDEX *x, long i)
+{
+	while (i >= 0 && x->e[i].type != 1) i--;
+	return i;
+}
+
+// the last I-picture captured at or before time, -1: none
+static inline long mpgindex_find(const MPGINDEX *x, int64_t time)
+{
+	long lo = 0, hi = x->n;
+	while (lo < hi) {
+		long m = lo + (hi - lo) / 2;
+		if (x->e[m].time <= time) {
+			lo = m + 1;
+		} else {
+			hi = m;
+		}
+	}
+	// lo-1 is in the group of the right I-picture even if the group is out of order
+	return mpgindex_key(x, lo-1);
+}
+
+// writer side, used by cam2mpg
+typedef struct {
+	FILE *fp;
+	int64_t clock;		// realtime minus monotonic in usec
+	MPGINDEX_ENTRY batch[MPGINDEX_BATCH];
+	int n;
+} MPGINDEX_WRITER;
+
+// append to the index of the recording name, -1 on error
+static inline int mpgindex_create(MPGINDEX_WRITER *w, const char *name)
+{
+	char path[4096];
+	struct timespec rt, mt;
+
+	memset(w, 0, sizeof(MPGINDEX_WRITER));
+	snprintf(path, sizeof(path), "%s.idx", name);
+	w->fp = fopen(path, "ab");
+	if (!w->fp) return -1;
+	fseek(w->fp, 0, SEEK_END);
+	if (!ftell(w->fp)) {
+		MPGINDEX_HEADER h = { MPGINDEX_MAGIC, sizeof(MPGINDEX_ENTRY), 0 };
+		fwrite(&h, sizeof(h), 1, w->fp);
+	}
+	// capture times are monotonic
+	clock_gettime(CLOCK_REALTIME, &rt);
+	clock_gettime(CLOCK_MONOTONIC, &mt);
+	w->clock = (rt.tv_sec - mt.tv_sec) * 1000000LL + (rt.tv_nsec - mt.tv_nsec) / 1000;
+	return 0;
+}
+
+static inline void mpgindex_flush(MPGINDEX_WRITER *w)
+{
+	if (!w->n) return;
+	fwrite(w->batch, sizeof(MPGINDEX_ENTRY), w->n, w->fp);
+	fflush(w->fp);
+	w->n = 0;
+}
+
+// a picture written at offset, time is its monotonic capture time;
+// the entries go out once the batch is full or with each I-picture, so they follow the data closely
+static inline void mpgindex_add(MPGINDEX_WRITER *w, int64_t time, uint64_t offset, uint32_t size, int type)
+{
+	if (!w->fp) return;
+	if (type == 1) mpgindex_flush(w);
+	MPGINDEX_ENTRY *e = &w->batch[w->n++];
+	e->time = time + w->clock;
+	e->offset = offset;
+	e->size = size;
+	e->type = type;
+	if (w->n == MPGINDEX_BATCH) mpgindex_flush(w);
+}
+
+static inline void mpgindex_finish(MPGINDEX_WRITER *w)
+{
+	if (!w->fp) return;
+	mpgindex_flush(w);
+	fclose(w->fp);
+	w->fp = 0;
+}
+
+#endif
@@ -0,0 +1,107 @@
+//---------------------------------------------------------
+//	Catlive
+//
+//		©2017 Yuichiro Nakada
+//---------------------------------------------------------
+
+// Cut a clip out of a recording of cam2mpg -I by its frame index,
+// from the I-picture before a time on, without scanning the file.
+//
+//	$ ./mpgseek cam.mpg "2017-06-01 12:30:00" 60 | ffplay -
+
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "mpgindex.h"
+
+// "YYYY-MM-DD HH:MM:SS" in local time or "@seconds" since the epoch, usec
+static int64_t parseTime(const char *s)
+{
+	if (*s == '@') return (int64_t)(atof(s+1) * 1000000);
+	struct tm tm;
+	memset(&tm, 0, sizeof(tm));
+	const char *p = strptime(s, "%Y-%m-%d %H:%M:%S", &tm);
+	if (!p || *p) {
+		fprintf(stderr, "Bad time '%s'\n", s);
+		exit(EXIT_FAILURE);
+	}
+	tm.tm_isdst = -1;
+	return mktime(&tm) * 1000000LL;
+}
+
+static void printTime(const char *what, int64_t t)
+{
+	time_t s = t / 1000000;
+	char buf[64];
+	strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime(&s));
+	fprintf(stderr, "%s %s.%03d\n", what, buf, (int)(t % 1000000 / 1000));
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s file.mpg [time [sec]]\n"
+			"  time is \"YYYY-MM-DD HH:MM:SS\" or @seconds since the epoch\n"
+			"  writes sec seconds [all] from the I-picture before time to stdout,\n"
+			"  without time prints what the recording covers\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	char path[4096];
+	MPGINDEX x;
+	snprintf(path, sizeof(path), "%s.idx", argv[1]);
+	if (mpgindex_open(&x, path)) {
+		fprintf(stderr, "Cannot open '%s': %d, %s\n", path, errno, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	if (!x.n) {
+		fprintf(stderr, "%s is empty\n", path);
+		return EXIT_FAILURE;
+	}
+
+	if (argc < 3) {
+		long keys = 0;
+		for (long i=0; i<x.n; i++) keys += x.e[i].type == 1;
+		printTime("from", x.e[0].time);
+		printTime("to  ", x.e[x.n-1].time);
+		fprintf(stderr, "%ld pictures, %ld I-pictures\n", x.n, keys);
+		return 0;
+	}
+
+	int64_t t = parseTime(argv[2]);
+	int64_t end = argc > 3 ? t + (int64_t)(atof(argv[3]) * 1000000) : INT64_MAX;
+	long i = mpgindex_find(&x, t);
+	if (i < 0) {
+		// before the recording, from its first I-picture on
+		for (i=0; i<x.n && x.e[i].type != 1; i++);
+		if (i == x.n) {
+			fprintf(stderr, "No I-picture in '%s'\n", path);
+			return EXIT_FAILURE;
+		}
+	}
+	// up to the first I-picture after end
+	long j = i+1;
+	while (j < x.n && (x.e[j].type != 1 || x.e[j].time <= end)) j++;
+	printTime("from", x.e[i].time);
+
+	FILE *fp = fopen(argv[1], "rb");
+	if (!fp || fseek(fp, x.e[i].offset, SEEK_SET)) {
+		fprintf(stderr, "Cannot open '%s': %d, %s\n", argv[1], errno, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	uint64_t left = x.e[j-1].offset + x.e[j-1].size - x.e[i].offset;
+	static unsigned char buf[1<<16];
+	while (left) {
+		size_t n = fread(buf, 1, left < sizeof(buf) ? left : sizeof(buf), fp);
+		if (!n) break;
+		fwrite(buf, 1, n, stdout);
+		left -= n;
+	}
+	static const unsigned char endCode[4] = { 0, 0, 1, 0xb7 };
+	fwrite(endCode, 1, 4, stdout);
+	fclose(fp);
+	mpgindex_close(&x);
+	return 0;
+}
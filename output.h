@@ -0,0 +1,664 @@
+//---------------------------------------------------------
+//	Catlive
+//
+//		©2017 Yuichiro Nakada
+//---------------------------------------------------------
+
+// Encoded outputs: each one scales the shared RGB frame to its own size
+// and encodes it on its own worker thread. In archive mode frames queue up
+// in a lookahead and are coded with B-pictures, out of display order.
+// An output named tcp:port or unix:path streams each slice once coded.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define OUTPUT_MAX	8
+#define OUTPUT_LOOKAHEAD	32	// queued pictures in archive mode
+#define OUTPUT_JPEG_QUALITY	85
+
+typedef struct {
+	int buf;		// frame in the pool
+	int rec, cut;
+	int snap;		// JPEG of this picture
+	int grey;		// luma only
+	int qboost;		// added to qscale while shedding load
+	long long time;		// capture time
+} OUTPUT_PIC;
+
+typedef struct {
+	char *name;
+	int width, height;	// 0: capture size
+	int qscale;
+	jo_mpeg_t enc;
+	unsigned char *rgb;	// scaled frame, NULL when encoding the capture size
+	unsigned char *mem;	// encoded frame
+	unsigned short *acc;	// box filter line sums
+	PREROLL_OBJ ring;
+	int count;
+
+	// handed over by output_post()
+	const unsigned char *src;
+	int sw, sh, rec;
+	int repeat;		// skip pictures before src
+	int cut;		// scene cut at src
+	int snap;		// JPEG of src
+	int grey;		// src has no colour
+	int qboost;		// added to qscale while shedding load
+	long long time;		// capture time of src
+
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int busy, quit;
+
+	// archive mode lookahead, frames are copied at capture size and shared by repeats
+	unsigned char *pool;
+	int *refs;		// queued pictures per pool frame
+	int poolSize;
+	OUTPUT_PIC queue[OUTPUT_LOOKAHEAD];
+	int qfirst, qn;
+	int flush;		// code what is queued without waiting for more
+	int dropped;
+
+	// JPEG snapshots from the coded pictures
+	char *snapName;		// NULL: none
+	int snapEvery;		// seconds between them, 0: on request only
+	long long snapNext;
+	float *coef;		// DCT of the picture
+	unsigned char *jpg;
+
+	STREAM_OBJ *stream;	// live stream instead of a file, NULL: file
+	int sent;		// bytes of mem streamed slice by slice
+
+	float cost;		// usec the last picture took to code, under mutex
+
+	MPGINDEX_WRITER index;	// frame index next to the file
+	long long offset;	// end of the file
+} OUTPUT_OBJ;
+
+static OUTPUT_OBJ outputs[OUTPUT_MAX];
+static int n_outputs = 0;
+
+// encoder settings shared by all outputs
+static struct {
+	int gopMin, gopMax;	// pictures between I-pictures
+	int aq;			// adaptive quantization
+	unsigned char *matrix;	// intra quantizer matrix, NULL: default
+	int anchor;		// archive mode: pictures between I/P-pictures, B-pictures between them, 0: off
+	int roi[4];		// x, y, w, h in capture pixels kept at full quality
+	int bgQ;		// quantiser_scale outside roi, 0: no region
+	int index;		// frame index next to each file
+} outputCfg = { 12, 300, 0, 0, 0 };
+
+// average of f*f pixel boxes, for integer factors
+static void scaleBox(const unsigned char *src, int sw, unsigned char *dst, int dw, int dh, int f, unsigned short *acc)
+{
+	int n = dw*3, div = f*f;
+	for (int y=0; y<dh; y++) {
+		const unsigned char *s = src + y*f*sw*3;
+		memset(acc, 0, dw*f*3*sizeof(unsigned short));
+		// sum f lines, 16 bytes at a time
+		for (int j=0; j<f; j++, s+=sw*3) {
+			int i = 0;
+#ifdef __SSE2__
+			for (; i+16<=dw*f*3; i+=16) {
+				__m128i v = _mm_loadu_si128((const __m128i*)(s+i));
+				__m128i *a = (__m128i*)(acc+i);
+				_mm_storeu_si128(a, _mm_add_epi16(_mm_loadu_si128(a), _mm_unpacklo_epi8(v, _mm_setzero_si128())));
+				_mm_storeu_si128(a+1, _mm_add_epi16(_mm_loadu_si128(a+1), _mm_unpackhi_epi8(v, _mm_setzero_si128())));
+			}
+#endif
+			for (; i<dw*f*3; i++) acc[i] += s[i];
+		}
+		unsigned char *d = dst + y*n;
+		for (int i=0; i<n; i+=3) {
+			const unsigned short *a = acc + i*f;
+			int r = 0, g = 0, b = 0;
+			for (int k=0; k<f*3; k+=3) {
+				r += a[k];
+				g += a[k+1];
+				b += a[k+2];
+			}
+			d[i]   = (r + div/2) / div;
+			d[i+1] = (g + div/2) / div;
+			d[i+2] = (b + div/2) / div;
+		}
+	}
+}
+
+// bilinear, 16.16 fixed point
+static void scaleBilinear(const unsigned char *src, int sw, int sh, unsigned char *dst, int dw, int dh)
+{
+	int dx = (sw << 16) / dw, dy = (sh << 16) / dh;
+	for (int y=0; y<dh; y++) {
+		int sy = y*dy + dy/2 - 0x8000;
+		sy = sy < 0 ? 0 : sy;
+		int y0 = sy >> 16, fy = (sy >> 8) & 255;
+		int y1 = y0+1 < sh ? y0+1 : y0;
+		const unsigned char *r0 = src + y0*sw*3, *r1 = src + y1*sw*3;
+		unsigned char *d = dst + y*dw*3;
+		for (int x=0; x<dw; x++) {
+			int sx = x*dx + dx/2 - 0x8000;
+			sx = sx < 0 ? 0 : sx;
+			int x0 = sx >> 16, fx = (sx >> 8) & 255;
+			int x1 = (x0+1 < sw ? x0+1 : x0)*3;
+			x0 *= 3;
+			for (int c=0; c<3; c++) {
+				int a = r0[x0+c]*(256-fx) + r0[x1+c]*fx;
+				int b = r1[x0+c]*(256-fx) + r1[x1+c]*fx;
+				*d++ = (a*(256-fy) + b*fy + 32768) >> 16;
+			}
+		}
+	}
+}
+
+// box filter for integer factors, bilinear otherwise; acc holds (sw+16)*3 sums
+static void scaleFrame(const unsigned char *src, int sw, int sh, unsigned char *dst, int dw, int dh, unsigned short *acc)
+{
+	int f = sw / dw;
+	if (f*dw == sw && f*dh == sh && f <= 16) {
+		scaleBox(src, sw, dst, dw, dh, f, acc);
+	} else {
+		scaleBilinear(src, sw, sh, dst, dw, dh);
+	}
+}
+
+static void outputScale(OUTPUT_OBJ *o)
+{
+	scaleFrame(o->src, o->sw, o->sh, o->rgb, o->width, o->height, o->acc);
+}
+
+// JPEG of the picture just coded if it was asked for, replaced in one go
+static void outputSnap(OUTPUT_OBJ *o)
+{
+	if (!o->enc.snap) return;
+	char tmp[PATH_MAX];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", o->snapName);
+	FILE *fp = fopen(tmp, "wb");
+	if (fp) {
+		fwrite(o->jpg, jo_mpeg_jpeg(&o->enc, o->jpg, OUTPUT_JPEG_QUALITY), 1, fp);
+		fclose(fp);
+		rename(tmp, o->snapName);
+	} else {
+		fprintf(stderr, "Cannot open '%s': %d, %s\n", tmp, errno, strerror(errno));
+	}
+	o->enc.snap = 0;
+}
+
+// a coded slice to the viewers, the first of an I-picture is where they can start
+static void outputSlice(void *arg, const unsigned char *p, int n)
+{
+	OUTPUT_OBJ *o = (OUTPUT_OBJ*)arg;
+	stream_push(o->stream, p, n, !o->sent && o->enc.type == 1);
+	o->sent += n;
+}
+
+static void outputPicture(OUTPUT_OBJ *o, FILE *fp, int s, int type, long long time)
+{
+	if (o->stream) {
+		stream_push(o->stream, o->mem + o->sent, s - o->sent, 0);
+		o->sent = 0;
+		o->count++;
+	} else if (fp) {
+		fwrite(o->mem, s, 1, fp);
+		mpgindex_add(&o->index, time, o->offset, s, type);
+		o->offset += s;
+		o->count++;
+	} else {
+		preroll_push(&o->ring, o->mem, s, type, time);
+	}
+}
+
+// the file while recording with the pre-roll moved into it, NULL while filling the pre-roll
+static int outputOpen(OUTPUT_OBJ *o, int rec, FILE **fp)
+{
+	*fp = 0;
+	if (!rec || o->stream) return 0;
+	*fp = fopen(o->name, "ab");
+	if (!*fp) {
+		fprintf(stderr, "Cannot open '%s': %d, %s\n", o->name, errno, strerror(errno));
+		return -1;
+	}
+	fseek(*fp, 0, SEEK_END);
+	o->offset = ftell(*fp);
+	if (o->ring.n && !preroll_flush(&o->ring, *fp, &o->offset, &o->index)) {
+		o->enc.type = 0;	// no I-picture left in the pre-roll, start over
+	}
+	return 0;
+}
+
+// quantiser_scale of the next pictures, coarser while shedding load
+static void outputQuant(OUTPUT_OBJ *o, int qboost)
+{
+	int q = o->qscale + qboost;
+	o->enc.qscale = q > 31 ? 31 : q;
+	o->enc.skipLevel = 64 + 16*o->enc.qscale;
+}
+
+static void outputFrame(OUTPUT_OBJ *o)
+{
+	FILE *fp;
+	if (outputOpen(o, o->rec, &fp)) return;
+	outputQuant(o, o->qboost);
+
+	// the last picture again, cheap
+	int num, den;
+	jo_mpeg_rate(&o->enc, &num, &den);
+	for (int i=0; i<o->repeat && o->enc.type; i++) {
+		outputPicture(o, fp, jo_mpeg_skip(&o->enc, o->mem), 2, o->time - (o->repeat - i) * 1000000LL*den/num);
+	}
+
+	const unsigned char *rgb = o->src;
+	if (o->rgb) {
+		outputScale(o);
+		rgb = o->rgb;
+	}
+	// keep an I-picture in the pre-roll, or start one for a new viewer
+	if ((!fp && o->ring.frames && o->enc.tref >= o->ring.frames/2) || (o->stream && o->stream->wantKey)) {
+		o->enc.type = 0;
+	}
+	o->enc.snap = o->snap ? o->coef : 0;
+	o->enc.mono = o->grey;
+	int s = jo_mpeg_encode(&o->enc, o->mem, rgb, o->cut);
+	outputPicture(o, fp, s, o->enc.type, o->time);
+	outputSnap(o);
+
+	if (fp) fclose(fp);
+}
+
+static void *outputThread(void *arg)
+{
+	OUTPUT_OBJ *o = (OUTPUT_OBJ*)arg;
+	rt_thread(RT_ENCODE, o - outputs);
+
+	pthread_mutex_lock(&o->mutex);
+	for (;;) {
+		while (!o->busy && !o->quit) {
+			pthread_cond_wait(&o->cond, &o->mutex);
+		}
+		if (!o->busy) break;
+		pthread_mutex_unlock(&o->mutex);
+
+		long long t = shed_now();
+		outputFrame(o);
+		t = shed_now() - t;
+
+		pthread_mutex_lock(&o->mutex);
+		o->cost = t;
+		o->busy = 0;
+		pthread_cond_broadcast(&o->cond);
+	}
+	pthread_mutex_unlock(&o->mutex);
+	return 0;
+}
+
+static OUTPUT_PIC *outputPic(OUTPUT_OBJ *o, int i)
+{
+	return &o->queue[(o->qfirst + i) % OUTPUT_LOOKAHEAD];
+}
+
+// scaled frame of a queued picture, coded grey if it is
+static const unsigned char *outputSource(OUTPUT_OBJ *o, OUTPUT_PIC *p)
+{
+	o->enc.mono = p->grey;
+	o->src = o->pool + (size_t)p->buf*o->sw*o->sh*3;
+	if (!o->rgb) return o->src;
+	outputScale(o);
+	return o->rgb;
+}
+
+// code the next pictures of the queue: an I-picture alone or up to anchor pictures,
+// the last of them as P-picture first and the ones before it as B-pictures, returns how many
+static int outputBatch(OUTPUT_OBJ *o, int avail)
+{
+	jo_mpeg_t *e = &o->enc;
+	OUTPUT_PIC *p = outputPic(o, 0);
+	FILE *fp;
+	if (outputOpen(o, p->rec, &fp)) return 1;
+	outputQuant(o, p->qboost);
+	if (o->stream && o->stream->wantKey) {
+		e->type = 0;	// a new viewer starts with an I-picture
+	}
+
+	int dist = e->tref + 1;	// pictures since the last I-picture
+	int n = 0, intra = 0;
+	for (; n < avail && n < outputCfg.anchor; n++) {
+		OUTPUT_PIC *q = outputPic(o, n);
+		int d = dist + n;
+		if (n && q->rec != p->rec) break;	// pictures of a batch go to the same place
+		// a new GOP, also to keep an I-picture in the pre-roll
+		if (!e->type || d >= e->gopMax || d >= 900 || (q->cut && d >= e->gopMin)
+			|| (!q->rec && o->ring.frames && d >= o->ring.frames/2) || (q->grey && !e->grey[e->bwd])) {
+			intra = !n;
+			n += intra;
+			break;
+		}
+	}
+
+	if (intra) {
+		e->snap = p->snap ? o->coef : 0;
+		outputPicture(o, fp, jo_mpeg_picture(e, o->mem, outputSource(o, p), 1, 0), 1, p->time);
+		outputSnap(o);
+	} else {
+		OUTPUT_PIC *q = outputPic(o, n-1);
+		e->snap = q->snap ? o->coef : 0;
+		outputPicture(o, fp, jo_mpeg_picture(e, o->mem, outputSource(o, q), 2, dist+n-1), 2, q->time);
+		outputSnap(o);
+		for (int i=0; i<n-1; i++) {
+			q = outputPic(o, i);
+			e->snap = q->snap ? o->coef : 0;
+			outputPicture(o, fp, jo_mpeg_picture(e, o->mem, outputSource(o, q), 3, dist+i), 3, q->time);
+			outputSnap(o);
+		}
+	}
+
+	if (fp) fclose(fp);
+	return n;
+}
+
+static int outputReady(OUTPUT_OBJ *o)
+{
+	if (!o->qn) return o->quit;
+	return o->quit || o->flush || o->qn >= outputCfg.anchor || outputPic(o, 0)->rec != outputPic(o, o->qn-1)->rec;
+}
+
+static void *outputArchive(void *arg)
+{
+	OUTPUT_OBJ *o = (OUTPUT_OBJ*)arg;
+	rt_thread(RT_ENCODE, o - outputs);
+
+	pthread_mutex_lock(&o->mutex);
+	for (;;) {
+		while (!outputReady(o)) {
+			pthread_cond_wait(&o->cond, &o->mutex);
+		}
+		if (!o->qn) break;
+		int avail = o->qn;
+		pthread_mutex_unlock(&o->mutex);
+
+		long long t = shed_now();
+		int n = outputBatch(o, avail);
+		t = shed_now() - t;
+
+		pthread_mutex_lock(&o->mutex);
+		o->cost = (float)t / n;
+		for (int i=0; i<n; i++) {
+			o->refs[outputPic(o, i)->buf]--;
+		}
+		o->qfirst = (o->qfirst + n) % OUTPUT_LOOKAHEAD;
+		o->qn -= n;
+		if (!o->qn) o->flush = 0;
+	}
+	pthread_mutex_unlock(&o->mutex);
+	return 0;
+}
+
+// copy a frame into the lookahead, it is dropped when the encoder is too far behind
+static void outputQueue(OUTPUT_OBJ *o, const unsigned char *src, int rec, int repeat, int cut, int snap, int grey, int qboost, long long time)
+{
+	int num, den;
+	jo_mpeg_rate(&o->enc, &num, &den);
+	pthread_mutex_lock(&o->mutex);
+	int b = 0;
+	while (b < o->poolSize && o->refs[b]) b++;
+	if (b == o->poolSize || o->qn == OUTPUT_LOOKAHEAD) {
+		o->dropped++;
+	} else {
+		memcpy(o->pool + (size_t)b*o->sw*o->sh*3, src, o->sw*o->sh*3);
+		for (int i=0; i<=repeat && o->qn < OUTPUT_LOOKAHEAD; i++) {
+			OUTPUT_PIC *p = outputPic(o, o->qn++);
+			p->buf = b;
+			p->rec = rec;
+			p->cut = cut && !i;
+			p->snap = snap && !i;
+			p->grey = grey;
+			p->qboost = qboost;
+			p->time = time - (repeat - i) * 1000000LL*den/num;
+			o->refs[b]++;
+		}
+		pthread_cond_broadcast(&o->cond);
+	}
+	pthread_mutex_unlock(&o->mutex);
+}
+
+// parse "[WxH[@q]:]filename"
+static int output_add(char *spec)
+{
+	if (n_outputs >= OUTPUT_MAX) {
+		fprintf(stderr, "Too many outputs, %d at most\n", OUTPUT_MAX);
+		return -1;
+	}
+	OUTPUT_OBJ *o = &outputs[n_outputs];
+	memset(o, 0, sizeof(OUTPUT_OBJ));
+	o->name = spec;
+	o->qscale = 8;
+
+	char *p = strchr(spec, ':');
+	if (p && sscanf(spec, "%dx%d", &o->width, &o->height) == 2) {
+		char *q = strchr(spec, '@');
+		if (q && q < p) o->qscale = atoi(q+1);
+		o->name = p+1;
+		if (o->width <= 0 || o->height <= 0) {
+			fprintf(stderr, "Bad output size '%s'\n", spec);
+			return -1;
+		}
+	} else {
+		o->width = o->height = 0;
+	}
+
+	n_outputs++;
+	return 0;
+}
+
+// the region of interest of a sw x sh capture in the coded picture
+static void outputRoi(jo_mpeg_t *e, int sw, int sh)
+{
+	if (!outputCfg.bgQ) return;
+	int x = outputCfg.roi[0] * e->width / sw;
+	int y = outputCfg.roi[1] * e->height / sh;
+	int w = (outputCfg.roi[0] + outputCfg.roi[2]) * e->width / sw - x;
+	int h = (outputCfg.roi[1] + outputCfg.roi[3]) * e->height / sh - y;
+	jo_mpeg_roi(e, x, y, w, h, outputCfg.bgQ);
+}
+
+// "[sec:]file" JPEG snapshots of the last output added, every sec seconds or on request
+static int output_snapshot(char *spec)
+{
+	if (!n_outputs) {
+		fprintf(stderr, "Snapshots are taken from an output, give it first\n");
+		return -1;
+	}
+	OUTPUT_OBJ *o = &outputs[n_outputs-1];
+	char *p = strchr(spec, ':');
+	o->snapName = p ? p+1 : spec;
+	o->snapEvery = p ? atoi(spec) : 0;
+	if (o->snapEvery < 0 || !*o->snapName) {
+		fprintf(stderr, "Bad snapshot '%s'\n", spec);
+		return -1;
+	}
+	return 0;
+}
+
+// snapshot with the frame captured at ts: asked for now or the interval is over
+static int output_snapDue(OUTPUT_OBJ *o, long long ts, int now)
+{
+	if (!o->snapName) return 0;
+	if (o->snapEvery && ts >= o->snapNext) {
+		o->snapNext = ts + o->snapEvery*1000000LL;
+		return 1;
+	}
+	return now;
+}
+
+static void output_start(OUTPUT_OBJ *o, int sw, int sh, float fps)
+{
+	if (!o->width || (o->width == sw && o->height == sh)) {
+		o->width = sw;
+		o->height = sh;
+	} else {
+		o->rgb = (unsigned char*)rt_alloc(o->width*o->height*3);
+		o->acc = (unsigned short*)rt_alloc((sw+16)*3*sizeof(unsigned short));
+		if (!o->rgb || !o->acc) {
+			fprintf(stderr, "Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	o->mem = (unsigned char*)rt_alloc(JO_MPEG_MAXSIZE(o->width, o->height));
+	if (!o->mem) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	jo_mpeg_init(&o->enc, o->width, o->height, fps, o->qscale);
+	o->enc.strip = (float*)rt_alloc(JO_MPEG_STRIPSIZE(o->width)*sizeof(float));
+	if (!o->enc.strip) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	o->enc.aq = outputCfg.aq;
+	if (outputCfg.matrix) {
+		jo_mpeg_matrix(&o->enc, outputCfg.matrix);
+	}
+	outputRoi(&o->enc, sw, sh);
+	o->stream = stream_open(o->name);
+	if (o->stream) {
+		o->enc.slice = outputSlice;
+		o->enc.sliceArg = o;
+	} else if (outputCfg.index && mpgindex_create(&o->index, o->name)) {
+		fprintf(stderr, "Cannot open the index of '%s': %d, %s\n", o->name, errno, strerror(errno));
+	}
+	if (o->snapName) {
+		o->coef = (float*)rt_alloc(JO_MPEG_SNAPSIZE(o->width, o->height)*sizeof(float));
+		o->jpg = (unsigned char*)rt_alloc(JO_MPEG_JPEGSIZE(o->width, o->height));
+		if (!o->coef || !o->jpg) {
+			fprintf(stderr, "Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (outputCfg.gopMax > 1) {
+		o->enc.gopMin = outputCfg.gopMin;
+		o->enc.gopMax = outputCfg.gopMax;
+		o->enc.ref = (unsigned char*)rt_alloc(JO_MPEG_REFSIZE(o->width, o->height));
+		if (!o->enc.ref) {
+			fprintf(stderr, "Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (outputCfg.anchor) {
+		// the P-picture of a batch waits for its B-pictures, one more batch comes in meanwhile
+		o->sw = sw;
+		o->sh = sh;
+		o->poolSize = 2*outputCfg.anchor + 2;
+		o->pool = (unsigned char*)rt_alloc((size_t)o->poolSize*sw*sh*3);
+		o->refs = (int*)calloc(o->poolSize, sizeof(int));
+		if (!o->pool || !o->refs) {
+			fprintf(stderr, "Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		o->enc.search = 8;
+	}
+
+	pthread_mutex_init(&o->mutex, 0);
+	pthread_cond_init(&o->cond, 0);
+	if (pthread_create(&o->thread, 0, outputCfg.anchor ? outputArchive : outputThread, o)) {
+		fprintf(stderr, "Cannot start the encoder for '%s'\n", o->name);
+		exit(EXIT_FAILURE);
+	}
+}
+
+// wait until the worker is done with the last frame, returns the usec its last picture took
+static float output_wait(OUTPUT_OBJ *o)
+{
+	pthread_mutex_lock(&o->mutex);
+	while (o->busy) {
+		pthread_cond_wait(&o->cond, &o->mutex);
+	}
+	float cost = o->cost;
+	pthread_mutex_unlock(&o->mutex);
+	return cost;
+}
+
+// the worker is still on earlier frames
+static int output_busy(OUTPUT_OBJ *o)
+{
+	pthread_mutex_lock(&o->mutex);
+	int busy = outputCfg.anchor ? o->qn >= outputCfg.anchor : o->busy;
+	pthread_mutex_unlock(&o->mutex);
+	return busy;
+}
+
+// hand a frame captured at time to the worker, src has to stay valid until output_wait();
+// a grey frame has R = G = B and is coded without chroma, qboost coarsens its quantiser
+static void output_post(OUTPUT_OBJ *o, const unsigned char *src, int sw, int sh, int rec, int repeat, int cut, int snap, int grey, int qboost, long long time)
+{
+	if (outputCfg.anchor) {
+		outputQueue(o, src, rec, repeat, cut, snap, grey, qboost, time);
+		return;
+	}
+	pthread_mutex_lock(&o->mutex);
+	o->src = src;
+	o->sw = sw;
+	o->sh = sh;
+	o->rec = rec;
+	o->repeat = repeat;
+	o->cut = cut;
+	o->snap = snap;
+	o->grey = grey;
+	o->qboost = qboost;
+	o->time = time;
+	o->busy = 1;
+	pthread_cond_broadcast(&o->cond);
+	pthread_mutex_unlock(&o->mutex);
+}
+
+// code the queued frames now, no more follow for a while
+static void output_flush(OUTPUT_OBJ *o)
+{
+	pthread_mutex_lock(&o->mutex);
+	o->flush = 1;
+	pthread_cond_broadcast(&o->cond);
+	pthread_mutex_unlock(&o->mutex);
+}
+
+static void output_stop(OUTPUT_OBJ *o)
+{
+	pthread_mutex_lock(&o->mutex);
+	o->quit = 1;
+	pthread_cond_broadcast(&o->cond);
+	pthread_mutex_unlock(&o->mutex);
+	pthread_join(o->thread, 0);
+	if (o->dropped) {
+		fprintf(stderr, "%s: %d frames dropped\n", o->name, o->dropped);
+	}
+
+	if (o->count && o->stream) {
+		stream_push(o->stream, o->mem, jo_mpeg_end(&o->enc, o->mem), 0);
+	} else if (o->count) {
+		FILE *fp = fopen(o->name, "ab");
+		if (fp) {
+			fwrite(o->mem, jo_mpeg_end(&o->enc, o->mem), 1, fp);
+			fclose(fp);
+		}
+	}
+	if (o->stream) stream_close(o->stream);
+	mpgindex_finish(&o->index);
+
+	pthread_mutex_destroy(&o->mutex);
+	pthread_cond_destroy(&o->cond);
+	preroll_free(&o->ring);
+	rt_free(o->rgb);
+	rt_free(o->acc);
+	rt_free(o->mem);
+	rt_free(o->enc.ref);
+	rt_free(o->enc.strip);
+	rt_free(o->pool);
+	free(o->refs);
+	rt_free(o->coef);
+	rt_free(o->jpg);
+}
@@ -0,0 +1,186 @@
+//---------------------------------------------------------
+//	Catlive
+//
+//		©2017 Yuichiro Nakada
+//---------------------------------------------------------
+
+// Real-time placement: threads pinned to cores or NUMA nodes by their role,
+// SCHED_FIFO for capture, and frame buffers from huge pages locked in memory.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define RT_CPUS		1024
+#define RT_BITS		(8*sizeof(unsigned long))
+#define RT_OUTPUTS	8	// outputs with a placement of their own
+#define RT_HUGE		(2UL<<20)	// huge page size
+#define RT_BLOCKS	256	// mappings at a time
+
+enum {
+	RT_CAPTURE,	// main loop: capture, analysis and conversion
+	RT_ENCODE,	// encoder threads
+	RT_WRITER,	// stream and frame bus servers
+	RT_ROLES
+};
+
+typedef struct {
+	unsigned long mask[RT_CPUS/RT_BITS];
+	int set;
+} RT_CPUSET;
+
+typedef struct {
+	RT_CPUSET role[RT_ROLES];
+	RT_CPUSET output[RT_OUTPUTS];	// encoder of output n, before RT_ENCODE
+	int fifo;		// SCHED_FIFO priority of capture, 0: normal
+	int huge;		// buffers from rt_alloc() in huge pages
+
+	struct {
+		void *p;
+		size_t size;
+		int shared;	// holds small buffers, stays mapped
+	} block[RT_BLOCKS];	// mappings of rt_alloc()
+	int blocks;
+	unsigned char *small;	// buffers of less than half a huge page share one
+	size_t smallUsed;
+} RT_OBJ;
+
+static RT_OBJ rt;
+
+// "0,2-3" or "node1" with the cpus of NUMA node 1
+static int rtList(RT_CPUSET *s, const char *list)
+{
+	char buf[1024];
+	int node;
+	if (sscanf(list, "node%d", &node) == 1) {
+		snprintf(buf, sizeof(buf), "/sys/devices/system/node/node%d/cpulist", node);
+		FILE *fp = fopen(buf, "r");
+		if (!fp) return -1;
+		if (!fgets(buf, sizeof(buf), fp)) buf[0] = 0;
+		fclose(fp);
+		list = buf;
+	}
+	memset(s, 0, sizeof(RT_CPUSET));
+	for (const char *p = list; *p && *p != '\n';) {
+		char *e;
+		long a = strtol(p, &e, 10), b = a;
+		if (e == p) return -1;
+		if (*e == '-') {
+			p = e+1;
+			b = strtol(p, &e, 10);
+			if (e == p) return -1;
+		}
+		if (a < 0 || b < a || b >= RT_CPUS || (*e && *e != ',' && *e != '\n')) return -1;
+		for (long c=a; c<=b; c++) {
+			s->mask[c / RT_BITS] |= 1UL << (c % RT_BITS);
+		}
+		p = *e == ',' ? e+1 : e;
+	}
+	s->set = 1;
+	return 0;
+}
+
+// "[capture|encode|writer|n:]cpus", n is the output in the order given, without a role all of them
+static int rt_cpus(const char *spec)
+{
+	static const char *roles[RT_ROLES] = { "capture:", "encode:", "writer:" };
+	for (int i=0; i<RT_ROLES; i++) {
+		if (!strncmp(spec, roles[i], strlen(roles[i]))) {
+			return rtList(&rt.role[i], spec + strlen(roles[i]));
+		}
+	}
+	int n;
+	char c;
+	if (sscanf(spec, "%d%c", &n, &c) == 2 && c == ':') {
+		if (n < 1 || n > RT_OUTPUTS) return -1;
+		return rtList(&rt.output[n-1], strchr(spec, ':')+1);
+	}
+	RT_CPUSET s;
+	if (rtList(&s, spec)) return -1;
+	for (int i=0; i<RT_ROLES; i++) rt.role[i] = s;
+	return 0;
+}
+
+// place the calling thread, output is the index of its output or -1
+static void rt_thread(int role, int output)
+{
+	RT_CPUSET *s = output >= 0 && output < RT_OUTPUTS && rt.output[output].set ? &rt.output[output] : &rt.role[role];
+	if (s->set && syscall(SYS_sched_setaffinity, 0, sizeof(s->mask), s->mask) < 0) {
+		fprintf(stderr, "Cannot set the cpus: %d, %s\n", errno, strerror(errno));
+	}
+	if (role == RT_CAPTURE && rt.fifo) {
+		struct sched_param param = { rt.fifo };
+		int r = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+		if (r) fprintf(stderr, "Cannot use SCHED_FIFO: %d, %s\n", r, strerror(r));
+	}
+}
+
+static void *rtMap(size_t len, int shared)
+{
+	if (rt.blocks == RT_BLOCKS) {
+		fprintf(stderr, "More than %d huge page buffers\n", RT_BLOCKS);
+		return 0;
+	}
+	void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (p == MAP_FAILED) {
+		// no huge pages reserved, transparent ones then
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED) return 0;
+		madvise(p, len, MADV_HUGEPAGE);
+	}
+	if (mlock(p, len)) {
+		static int warned = 0;
+		if (!warned++) fprintf(stderr, "Cannot lock buffers in memory: %d, %s\n", errno, strerror(errno));
+	}
+	rt.block[rt.blocks].p = p;
+	rt.block[rt.blocks].size = len;
+	rt.block[rt.blocks].shared = shared;
+	rt.blocks++;
+	return p;
+}
+
+// buffer with a mapping of its own that rt_free() gives back, for those freed and allocated
+// again while running, like the capture buffers on every reopen
+static void *rt_allocOwn(size_t size)
+{
+	if (!rt.huge) return malloc(size);
+	return rtMap((size + RT_HUGE-1) & ~(RT_HUGE-1), 0);
+}
+
+// frame or scratch buffer, page aligned from huge pages with -G, malloc() otherwise
+static void *rt_alloc(size_t size)
+{
+	if (size >= RT_HUGE/2) return rt_allocOwn(size);
+	if (!rt.huge) return malloc(size);
+	size = (size + 4095) & ~4095UL;
+	if (!rt.small || rt.smallUsed + size > RT_HUGE) {
+		rt.small = (unsigned char*)rtMap(RT_HUGE, 1);
+		rt.smallUsed = 0;
+		if (!rt.small) return 0;
+	}
+	void *p = rt.small + rt.smallUsed;
+	rt.smallUsed += size;
+	return p;
+}
+
+// buffers that share a huge page stay until the end, one may start where the page does
+static void rt_free(void *p)
+{
+	if (!rt.huge) {
+		free(p);
+		return;
+	}
+	for (int i=0; i<rt.blocks; i++) {
+		if (rt.block[i].p == p && !rt.block[i].shared) {
+			munmap(p, rt.block[i].size);
+			rt.block[i] = rt.block[--rt.blocks];
+			return;
+		}
+	}
+}
@@ -0,0 +1,34 @@
+//---------------------------------------------------------
+//	Catlive
+//
+//		©2017 Yuichiro Nakada
+//---------------------------------------------------------
+
+// Scene cut detection on the downscaled luma grid of motion.h
+
+#define SCENE_SAD	16	// mean luma change of a cell
+#define SCENE_HIST	35	// % of the histogram that moved
+
+typedef struct {
+	int hist[2][32];
+	int cur;
+} SCENE_OBJ;
+
+// return 1 on a cut or a lighting jump, for example IR switching or lights turned on
+static int scene_cut(SCENE_OBJ *s, MOTION_OBJ *m)
+{
+	int n = m->gw*m->gh;
+	int *h = s->hist[s->cur ^= 1], *p = s->hist[s->cur ^ 1];
+
+	memset(h, 0, sizeof(s->hist[0]));
+	for (int i=0; i<n; i++) {
+		h[m->grid[i]>>3]++;
+	}
+
+	int d = 0;
+	for (int i=0; i<32; i++) {
+		d += h[i] > p[i] ? h[i] - p[i] : p[i] - h[i];
+	}
+	// d counts every moved cell twice
+	return motion_sad(m->grid, m->prev, n) > SCENE_SAD*n && d*100 > SCENE_HIST*2*n;
+}
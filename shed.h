@@ -0,0 +1,87 @@
+//---------------------------------------------------------
+//	Catlive
+//
+//		©2017 Yuichiro Nakada
+//---------------------------------------------------------
+
+// Load shedding: compares the time a frame costs with the frame interval and
+// gives up quality step by step while it does not fit, and takes the steps
+// back once it fits again. Every step is reported on stderr.
+
+#include <stdio.h>
+#include <time.h>
+
+enum {
+	SHED_NONE,
+	SHED_QUANT,	// coarser quantiser_scale
+	SHED_ANALYSIS,	// no denoise, motion and scene cut detection
+	SHED_RATE,	// every second frame, the others repeat the last picture
+	SHED_DROP,	// frames the encoders are not ready for are dropped
+	SHED_LEVELS
+};
+
+#define SHED_QBOOST	6	// added to quantiser_scale
+#define SHED_UP		0.95f	// load that sheds the next step
+#define SHED_DOWN	0.6f	// load that takes a step back
+#define SHED_HOLD	2000000LL	// usec between steps
+
+static const char *shed_names[SHED_LEVELS] = { "none", "quantizer", "analysis", "rate", "drop" };
+
+typedef struct {
+	int level;
+	long long budget;	// usec per output picture
+	float cost;		// usec a frame keeps the busiest stage, smoothed
+	float load;		// cost against the time there is for it
+	long long changed;	// time of the last step
+	long long frames[SHED_LEVELS];	// frames captured at each level
+	int steps;
+	int dropped;
+} SHED_OBJ;
+
+static long long shed_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void shed_init(SHED_OBJ *s, int num, int den)
+{
+	memset(s, 0, sizeof(SHED_OBJ));
+	s->budget = 1000000LL * den / num;
+	s->changed = shed_now();
+}
+
+// cost in usec of the frame just done by the busiest stage, returns the level for the next one
+static int shed_update(SHED_OBJ *s, float cost)
+{
+	long long t = shed_now();
+	s->frames[s->level]++;
+	s->cost = s->cost ? s->cost*0.9f + cost*0.1f : cost;
+	// from SHED_RATE on there is twice the time for each picture
+	s->load = s->cost / (s->budget * (s->level >= SHED_RATE ? 2 : 1));
+	if (t - s->changed < SHED_HOLD) return s->level;
+
+	int level = s->level;
+	if (s->load > SHED_UP && level < SHED_DROP) level++;
+	// back below SHED_RATE the same cost has half the time
+	if (s->load * (level == SHED_RATE ? 2 : 1) < SHED_DOWN && level > SHED_NONE) level--;
+	if (level != s->level) {
+		fprintf(stderr, "shed: %s -> %s, load %.2f, %.1f ms per frame of %.1f ms\n",
+			shed_names[s->level], shed_names[level], s->load, s->cost/1000, s->budget/1000.f);
+		s->level = level;
+		s->changed = t;
+		s->steps++;
+	}
+	return s->level;
+}
+
+static void shed_report(SHED_OBJ *s)
+{
+	if (!s->steps) return;
+	fprintf(stderr, "shed: %d steps, frames", s->steps);
+	for (int i=0; i<SHED_LEVELS; i++) {
+		fprintf(stderr, " %s %lld", shed_names[i], s->frames[i]);
+	}
+	fprintf(stderr, ", %d dropped\n", s->dropped);
+}
@@ -0,0 +1,282 @@
+//---------------------------------------------------------
+//	Catlive
+//
+//		©2017 Yuichiro Nakada
+//---------------------------------------------------------
+
+// Live MPEG-1 video stream on a TCP or unix socket, for any number of viewers.
+// Slices go into a ring of refcounted segments as soon as they are coded and
+// every client is sent straight from there, several segments per sendmsg().
+// A client that falls behind the ring skips to the next I-picture.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define STREAM_SEGMENTS	1024	// slices kept for the clients
+#define STREAM_CLIENTS	32
+#define STREAM_IOV	64	// segments per sendmsg()
+
+typedef struct {
+	int refs;		// the ring and sends in progress
+	int len;
+	int key;		// starts an I-picture with its sequence header
+	unsigned char data[];
+} STREAM_SEG;
+
+typedef struct {
+	int fd;
+	unsigned long long next;	// segment to send
+	int off;			// bytes of it already sent
+	int waitKey;			// skip to the next I-picture
+} STREAM_CLIENT;
+
+typedef struct {
+	int sock;		// listening socket
+	const char *path;	// unix socket to remove, NULL: TCP
+	int event;		// eventfd, new segments and quit
+	STREAM_SEG *seg[STREAM_SEGMENTS];	// by number % STREAM_SEGMENTS
+	unsigned long long head;	// number of the next segment
+	STREAM_CLIENT client[STREAM_CLIENTS];
+	int clients;
+	volatile int wantKey;	// a client waits for an I-picture
+	int quit;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+} STREAM_OBJ;
+
+static void streamRelease(STREAM_SEG *s)
+{
+	if (s && !--s->refs) free(s);
+}
+
+// queue the next coded bytes, never waits for a client
+static void stream_push(STREAM_OBJ *s, const unsigned char *p, int n, int key)
+{
+	if (n <= 0) return;
+	STREAM_SEG *g = (STREAM_SEG*)malloc(sizeof(STREAM_SEG) + n);
+	if (!g) return;
+	g->refs = 1;
+	g->len = n;
+	g->key = key;
+	memcpy(g->data, p, n);
+
+	pthread_mutex_lock(&s->mutex);
+	STREAM_SEG **slot = &s->seg[s->head % STREAM_SEGMENTS];
+	streamRelease(*slot);
+	*slot = g;
+	s->head++;
+	if (key) s->wantKey = 0;
+	pthread_mutex_unlock(&s->mutex);
+
+	uint64_t one = 1;
+	if (write(s->event, &one, sizeof(one)) < 0) {
+		// the counter is full, the server is awake anyway
+	}
+}
+
+// send what is queued for c, 0 when the client is gone
+static int streamSend(STREAM_OBJ *s, STREAM_CLIENT *c)
+{
+	struct iovec iov[STREAM_IOV];
+	STREAM_SEG *held[STREAM_IOV];
+	int n = 0;
+
+	pthread_mutex_lock(&s->mutex);
+	unsigned long long tail = s->head > STREAM_SEGMENTS ? s->head - STREAM_SEGMENTS : 0;
+	if (c->next < tail) {
+		// fell behind, resume at an I-picture
+		c->next = tail;
+		c->off = 0;
+		c->waitKey = 1;
+	}
+	while (c->waitKey && c->next < s->head && !s->seg[c->next % STREAM_SEGMENTS]->key) {
+		c->next++;
+	}
+	if (c->waitKey) {
+		if (c->next < s->head) {
+			c->waitKey = 0;
+		} else {
+			s->wantKey = 1;
+		}
+	}
+	for (unsigned long long i = c->next; !c->waitKey && i < s->head && n < STREAM_IOV; i++, n++) {
+		STREAM_SEG *g = held[n] = s->seg[i % STREAM_SEGMENTS];
+		g->refs++;
+		int off = i == c->next ? c->off : 0;
+		iov[n].iov_base = g->data + off;
+		iov[n].iov_len = g->len - off;
+	}
+	pthread_mutex_unlock(&s->mutex);
+	if (!n) return 1;
+
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = n;
+	ssize_t r = sendmsg(c->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+	int alive = r >= 0 || errno == EAGAIN || errno == EINTR;
+
+	pthread_mutex_lock(&s->mutex);
+	for (int i=0; i<n; i++) {
+		if (r > 0) {
+			if ((size_t)r < iov[i].iov_len) {
+				c->off += r;
+				r = 0;
+			} else {
+				r -= iov[i].iov_len;
+				c->next++;
+				c->off = 0;
+			}
+		}
+		streamRelease(held[i]);
+	}
+	pthread_mutex_unlock(&s->mutex);
+	return alive;
+}
+
+static void streamAccept(STREAM_OBJ *s)
+{
+	int fd = accept(s->sock, NULL, NULL);
+	if (fd < 0) return;
+	if (s->clients == STREAM_CLIENTS) {
+		close(fd);
+		return;
+	}
+	int one = 1;
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	if (!s->path) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	STREAM_CLIENT *c = &s->client[s->clients++];
+	pthread_mutex_lock(&s->mutex);
+	c->fd = fd;
+	c->next = s->head;
+	c->off = 0;
+	c->waitKey = 1;
+	s->wantKey = 1;
+	pthread_mutex_unlock(&s->mutex);
+}
+
+static void *streamThread(void *arg)
+{
+	STREAM_OBJ *s = (STREAM_OBJ*)arg;
+	struct pollfd pfd[STREAM_CLIENTS+2];
+	rt_thread(RT_WRITER, -1);
+
+	while (!s->quit) {
+		pfd[0].fd = s->event;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = s->sock;
+		pfd[1].events = POLLIN;
+		pthread_mutex_lock(&s->mutex);
+		for (int i=0; i<s->clients; i++) {
+			STREAM_CLIENT *c = &s->client[i];
+			pfd[i+2].fd = c->fd;
+			// writable only matters with something to send, a hang up shows anyway
+			pfd[i+2].events = c->next < s->head && !c->waitKey ? POLLOUT : 0;
+		}
+		pthread_mutex_unlock(&s->mutex);
+		if (poll(pfd, s->clients+2, -1) < 0) continue;
+
+		if (pfd[0].revents & POLLIN) {
+			uint64_t v;
+			if (read(s->event, &v, sizeof(v)) < 0) {
+				// nothing, poll() woke us
+			}
+		}
+		int n = s->clients;
+		for (int i=n-1; i>=0; i--) {
+			STREAM_CLIENT *c = &s->client[i];
+			if ((pfd[i+2].revents & (POLLERR|POLLHUP|POLLNVAL)) || !streamSend(s, c)) {
+				close(c->fd);
+				*c = s->client[--s->clients];
+			}
+		}
+		if (pfd[1].revents & POLLIN) streamAccept(s);
+	}
+	return 0;
+}
+
+// "tcp:port" or "unix:path", NULL when spec is neither
+static STREAM_OBJ *stream_open(const char *spec)
+{
+	int tcp = !strncmp(spec, "tcp:", 4);
+	if (!tcp && strncmp(spec, "unix:", 5)) return 0;
+
+	STREAM_OBJ *s = (STREAM_OBJ*)calloc(1, sizeof(STREAM_OBJ));
+	if (!s) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	int r;
+	if (tcp) {
+		struct sockaddr_in addr;
+		int one = 1;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(atoi(spec+4));
+		addr.sin_addr.s_addr = htonl(INADDR_ANY);
+		s->sock = socket(AF_INET, SOCK_STREAM, 0);
+		setsockopt(s->sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		r = bind(s->sock, (struct sockaddr*)&addr, sizeof(addr));
+	} else {
+		struct sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, spec+5, sizeof(addr.sun_path)-1);
+		s->path = spec+5;
+		unlink(s->path);
+		s->sock = socket(AF_UNIX, SOCK_STREAM, 0);
+		r = bind(s->sock, (struct sockaddr*)&addr, sizeof(addr));
+	}
+	if (s->sock < 0 || r < 0 || listen(s->sock, 8) < 0) {
+		fprintf(stderr, "Cannot listen on '%s': %d, %s\n", spec, errno, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	fcntl(s->sock, F_SETFL, fcntl(s->sock, F_GETFL) | O_NONBLOCK);
+	s->event = eventfd(0, EFD_NONBLOCK);
+	if (s->event < 0) {
+		fprintf(stderr, "Cannot create the wake-up event for '%s': %d, %s\n", spec, errno, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	pthread_mutex_init(&s->mutex, 0);
+	if (pthread_create(&s->thread, 0, streamThread, s)) {
+		fprintf(stderr, "Cannot start the stream server for '%s'\n", spec);
+		exit(EXIT_FAILURE);
+	}
+	return s;
+}
+
+static void stream_close(STREAM_OBJ *s)
+{
+	uint64_t one = 1;
+	s->quit = 1;
+	if (write(s->event, &one, sizeof(one)) < 0) {
+		// the thread is awake anyway
+	}
+	pthread_join(s->thread, 0);
+	for (int i=0; i<s->clients; i++) {
+		// what is left, mostly the end code
+		while (s->client[i].next < s->head && !s->client[i].waitKey && streamSend(s, &s->client[i])) {
+			struct pollfd p = { s->client[i].fd, POLLOUT, 0 };
+			if (poll(&p, 1, 200) <= 0) break;
+		}
+		close(s->client[i].fd);
+	}
+	for (int i=0; i<STREAM_SEGMENTS; i++) streamRelease(s->seg[i]);
+	close(s->sock);
+	close(s->event);
+	if (s->path) unlink(s->path);
+	pthread_mutex_destroy(&s->mutex);
+	free(s);
+}
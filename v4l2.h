@@ -14,15 +14,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include <assert.h>
 #include <getopt.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
 #include <malloc.h>
+#include <signal.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/select.h>
+#include <time.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
 #include <asm/types.h>
@@ -57,6 +61,28 @@ typedef struct {
 	unsigned int width;
 	unsigned int height;
 	unsigned char *rgb;
+
+	unsigned char *yuyv;		// last captured frame, valid until the next v4l2_frameRead()
+	struct v4l2_buffer held;	// driver buffer backing yuyv
+	int holding;
+	long long timestamp;		// capture time of yuyv in usec
+
+	float fps;			// frame rate asked from the driver, 0: driver default
+
+	struct v4l2_rect roi;		// region of the WxH frame to capture, width 0: all of it
+	unsigned char *crop;		// ROI copied from each frame, NULL: the driver crops
+	unsigned int stride;		// bytes per line of the driver's frame
+
+	unsigned int askWidth, askHeight;	// size asked for, again on every reopen
+	long long last;			// monotonic usec of the last frame read
+	long long lost;			// last frame before the device failed, 0: running
+	int attempts;			// reopens since then
+	int outages;
+	long long down, downMax;	// usec without frames
+
+	int mono;			// take every frame as grey, else detect it
+	int grey;			// the current frame is converted and coded as grey
+	long long greySince;		// capture time of the first grey frame in a row, 0: colour
 } V4L2_OBJ;
 V4L2_OBJ v4l2 = { -1, 0, 0, IO_METHOD_MMAP, "/dev/video0", 640, 480 };
 
@@ -99,10 +125,41 @@ static void YUV422toRGB888(int width, int height, unsigned char *src, unsigned c
 	}
 }
 
-static void errno_exit(const char* s)
+#define V4L2_GREY_LEVEL	3	// U and V this close to 128 count as no colour
+#define V4L2_GREY_STEP	8	// sample every 8th pixel pair of every 8th line
+
+// 1 when the sampled U and V of a YUV422 frame carry no colour, the first coloured sample ends it
+static int YUV422isGrey(int width, int height, const unsigned char *src)
+{
+	for (int line=0; line < height; line += V4L2_GREY_STEP) {
+		const unsigned char *p = src + line*width*2 + 1;
+		for (int column=0; column < width; column += 2*V4L2_GREY_STEP, p += 4*V4L2_GREY_STEP) {
+			if (abs(p[0]-128) > V4L2_GREY_LEVEL || abs(p[2]-128) > V4L2_GREY_LEVEL) return 0;
+		}
+	}
+	return 1;
+}
+
+// Y of YUV422 into all three channels of RGB888, U and V are ignored
+static void YUV422toGrey888(int width, int height, const unsigned char *src, unsigned char *dst)
+{
+	for (int i=0; i < width*height; i++, dst += 3) {
+		dst[0] = dst[1] = dst[2] = src[i*2];
+	}
+}
+
+// report what failed, for the caller to return
+static int errno_fail(const char* s)
 {
 	fprintf(stderr, "%s error %d, %s\n", s, errno, strerror(errno));
-	exit(EXIT_FAILURE);
+	return -1;
+}
+
+static long long v4l2_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
 }
 
 static int xioctl(int fd, int request, void* argp)
@@ -114,13 +171,96 @@ static int xioctl(int fd, int request, void* argp)
 	return r;
 }
 
-static void imageProcess(const void* p)
+static void imageProcess(const void* p, const struct timeval *tv)
 {
-	// convert from YUV422 to RGB888
-	YUV422toRGB888(v4l2.width, v4l2.height, (unsigned char*)p, v4l2.rgb);
+	// keep the raw frame, conversion is done on demand
+	v4l2.yuyv = (unsigned char*)p;
+	if (v4l2.crop) {
+		const unsigned char *s = (const unsigned char*)p + v4l2.roi.top*v4l2.stride + v4l2.roi.left*2;
+		for (unsigned int y=0; y<v4l2.roi.height; y++) {
+			memcpy(v4l2.crop + y*v4l2.roi.width*2, s + y*v4l2.stride, v4l2.roi.width*2);
+		}
+		v4l2.yuyv = v4l2.crop;
+	}
+
+	if (tv && (tv->tv_sec || tv->tv_usec)) {
+		v4l2.timestamp = tv->tv_sec * 1000000LL + tv->tv_usec;
+	} else {
+		// read() has no timestamp, the driver's clock is monotonic too
+		v4l2.timestamp = v4l2_now();
+	}
+
+	v4l2.last = v4l2_now();
+	if (v4l2.lost) {
+		// first frame after an outage
+		long long t = v4l2.last - v4l2.lost;
+		v4l2.outages++;
+		v4l2.down += t;
+		if (t > v4l2.downMax) v4l2.downMax = t;
+		fprintf(stderr, "%s is back after %.0f ms, %d reopens\n", v4l2.deviceName, t/1000.0, v4l2.attempts);
+		v4l2.lost = 0;
+	}
 }
 
-// read single frame
+// keep buf until the next frame and give the previous one back to the driver
+static int bufferHold(struct v4l2_buffer *buf)
+{
+	if (v4l2.holding) {
+		if (-1 == xioctl(v4l2.fd, VIDIOC_QBUF, &v4l2.held)) {
+			v4l2.holding = 0;
+			return errno_fail("VIDIOC_QBUF");
+		}
+	}
+	v4l2.held = *buf;
+	v4l2.holding = 1;
+	return 0;
+}
+
+// convert the current frame from YUV422 to RGB888, or only its luma once it is grey for a second;
+// colour back ends that at once
+static void v4l2_frameRGB()
+{
+	int grey = v4l2.mono;
+	if (!grey) {
+		if (!YUV422isGrey(v4l2.width, v4l2.height, v4l2.yuyv)) {
+			v4l2.greySince = 0;
+		} else if (!v4l2.greySince) {
+			v4l2.greySince = v4l2.timestamp;
+		}
+		grey = v4l2.greySince && v4l2.timestamp - v4l2.greySince >= 1000000;
+		if (grey != v4l2.grey) {
+			fprintf(stderr, "%s is %s\n", v4l2.deviceName, grey ? "grey, coding luma only" : "in colour again");
+		}
+	}
+	v4l2.grey = grey;
+
+	if (grey) {
+		YUV422toGrey888(v4l2.width, v4l2.height, v4l2.yuyv, v4l2.rgb);
+	} else {
+		YUV422toRGB888(v4l2.width, v4l2.height, v4l2.yuyv, v4l2.rgb);
+	}
+}
+
+// wait up to msec for the next frame, 0 on timeout, -1 on error
+static int v4l2_frameWait(int msec)
+{
+	fd_set fds;
+	struct timeval tv = { msec / 1000, (msec % 1000) * 1000 };
+	int r;
+
+	FD_ZERO(&fds);
+	FD_SET(v4l2.fd, &fds);
+	r = select(v4l2.fd + 1, &fds, NULL, NULL, &tv);
+	if (-1 == r) {
+		if (EINTR == errno) {
+			return 0;
+		}
+		return errno_fail("select");
+	}
+	return r;
+}
+
+// read single frame, 0: none yet, -1: the device failed
 static int v4l2_frameRead()
 {
 	struct v4l2_buffer buf;
@@ -141,11 +281,11 @@ static int v4l2_frameRead()
 
 			// fall through
 			default:
-				errno_exit("read");
+				return errno_fail("read");
 			}
 		}
 
-		imageProcess(v4l2.buffers[0].start);
+		imageProcess(v4l2.buffers[0].start, 0);
 		break;
 #endif
 
@@ -166,18 +306,14 @@ static int v4l2_frameRead()
 
 			// fall through
 			default:
-				errno_exit("VIDIOC_DQBUF");
+				return errno_fail("VIDIOC_DQBUF");
 			}
 		}
 
 		assert(buf.index < v4l2.n_buffers);
 
-		imageProcess(v4l2.buffers[buf.index].start);
-
-		if (-1 == xioctl(v4l2.fd, VIDIOC_QBUF, &buf)) {
-			errno_exit("VIDIOC_QBUF");
-		}
-
+		imageProcess(v4l2.buffers[buf.index].start, &buf.timestamp);
+		if (bufferHold(&buf)) return -1;
 		break;
 #endif
 
@@ -198,7 +334,7 @@ static int v4l2_frameRead()
 
 			// fall through
 			default:
-				errno_exit("VIDIOC_DQBUF");
+				return errno_fail("VIDIOC_DQBUF");
 
 			}
 		}
@@ -211,11 +347,8 @@ static int v4l2_frameRead()
 
 		assert(i < v4l2.n_buffers);
 
-		imageProcess((void *) buf.m.userptr);
-
-		if (-1 == xioctl(v4l2.fd, VIDIOC_QBUF, &buf)) {
-			errno_exit("VIDIOC_QBUF");
-		}
+		imageProcess((void *) buf.m.userptr, &buf.timestamp);
+		if (bufferHold(&buf)) return -1;
 		break;
 #endif
 	}
@@ -223,7 +356,7 @@ static int v4l2_frameRead()
 	return 1;
 }
 
-static void v4l2_captureStop()
+static int v4l2_captureStop()
 {
 	enum v4l2_buf_type type;
 
@@ -242,16 +375,18 @@ static void v4l2_captureStop()
 #if defined(IO_MMAP) || defined(IO_USERPTR)
 		type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 
+		v4l2.holding = 0;	// STREAMOFF dequeues everything
 		if (-1 == xioctl(v4l2.fd, VIDIOC_STREAMOFF, &type)) {
-			errno_exit("VIDIOC_STREAMOFF");
+			return errno_fail("VIDIOC_STREAMOFF");
 		}
 
 		break;
 #endif
 	}
+	return 0;
 }
 
-static void v4l2_captureStart()
+static int v4l2_captureStart()
 {
 	unsigned int i;
 	enum v4l2_buf_type type;
@@ -274,14 +409,14 @@ static void v4l2_captureStart()
 			buf.index       = i;
 
 			if (-1 == xioctl(v4l2.fd, VIDIOC_QBUF, &buf)) {
-				errno_exit("VIDIOC_QBUF");
+				return errno_fail("VIDIOC_QBUF");
 			}
 		}
 
 		type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 
 		if (-1 == xioctl(v4l2.fd, VIDIOC_STREAMON, &type)) {
-			errno_exit("VIDIOC_STREAMON");
+			return errno_fail("VIDIOC_STREAMON");
 		}
 
 		break;
@@ -300,74 +435,80 @@ static void v4l2_captureStart()
 			buf.length      = v4l2.buffers[i].length;
 
 			if (-1 == xioctl(v4l2.fd, VIDIOC_QBUF, &buf)) {
-				errno_exit("VIDIOC_QBUF");
+				return errno_fail("VIDIOC_QBUF");
 			}
 		}
 
 		type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 
 		if (-1 == xioctl(v4l2.fd, VIDIOC_STREAMON, &type)) {
-			errno_exit("VIDIOC_STREAMON");
+			return errno_fail("VIDIOC_STREAMON");
 		}
 
 		break;
 #endif
 	}
+	v4l2.last = v4l2_now();
+	return 0;
 }
 
+// also after a partial deviceInit()
 static void deviceUninit()
 {
 	unsigned int i;
 
+	if (!v4l2.buffers) return;
 	switch (v4l2.io) {
 #ifdef IO_READ
 	case IO_METHOD_READ:
-		free(v4l2.buffers[0].start);
+		rt_free(v4l2.buffers[0].start);
 		break;
 #endif
 
 #ifdef IO_MMAP
 	case IO_METHOD_MMAP:
-		for (i=0; i < v4l2.n_buffers; ++i)
-			if (-1 == munmap(v4l2.buffers[i].start, v4l2.buffers[i].length)) {
-				errno_exit("munmap");
-			}
+		for (i=0; i < v4l2.n_buffers; ++i) {
+			munmap(v4l2.buffers[i].start, v4l2.buffers[i].length);
+		}
 		break;
 #endif
 
 #ifdef IO_USERPTR
 	case IO_METHOD_USERPTR:
 		for (i=0; i < v4l2.n_buffers; ++i) {
-			free(v4l2.buffers[i].start);
+			rt_free(v4l2.buffers[i].start);
 		}
 		break;
 #endif
 	}
 
 	free(v4l2.buffers);
+	v4l2.buffers = 0;
+	v4l2.n_buffers = 0;
 }
 
 #ifdef IO_READ
-static void readInit(unsigned int buffer_size)
+static int readInit(unsigned int buffer_size)
 {
 	v4l2.buffers = (struct buffer*)calloc(1, sizeof(struct buffer));
 	if (!v4l2.buffers) {
 		fprintf(stderr, "Out of memory\n");
-		exit(EXIT_FAILURE);
+		return -1;
 	}
 
 	v4l2.buffers[0].length = buffer_size;
-	v4l2.buffers[0].start = malloc(buffer_size);
+	v4l2.buffers[0].start = rt_allocOwn(buffer_size);
 
 	if (!v4l2.buffers[0].start) {
 		fprintf(stderr, "Out of memory\n");
-		exit(EXIT_FAILURE);
+		return -1;
 	}
+	return 0;
 }
 #endif
 
 #ifdef IO_MMAP
-static void mmapInit()
+static int mmapInit()
 {
 	struct v4l2_requestbuffers req;
 
@@ -380,22 +521,22 @@ static void mmapInit()
 	if (-1 == xioctl(v4l2.fd, VIDIOC_REQBUFS, &req)) {
 		if (EINVAL == errno) {
 			fprintf(stderr, "%s does not support memory mapping\n", v4l2.deviceName);
-			exit(EXIT_FAILURE);
+			return -1;
 		} else {
-			errno_exit("VIDIOC_REQBUFS");
+			return errno_fail("VIDIOC_REQBUFS");
 		}
 	}
 
 	if (req.count < 2) {
 		fprintf(stderr, "Insufficient buffer memory on %s\n", v4l2.deviceName);
-		exit(EXIT_FAILURE);
+		return -1;
 	}
 
 	v4l2.buffers = (struct buffer*)calloc(req.count, sizeof(struct buffer));
 
 	if (!v4l2.buffers) {
 		fprintf(stderr, "Out of memory\n");
-		exit(EXIT_FAILURE);
+		return -1;
 	}
 
 	for (v4l2.n_buffers = 0; v4l2.n_buffers < req.count; ++v4l2.n_buffers) {
@@ -408,7 +549,7 @@ static void mmapInit()
 		buf.index       = v4l2.n_buffers;
 
 		if (-1 == xioctl(v4l2.fd, VIDIOC_QUERYBUF, &buf)) {
-			errno_exit("VIDIOC_QUERYBUF");
+			return errno_fail("VIDIOC_QUERYBUF");
 		}
 
 		v4l2.buffers[v4l2.n_buffers].length = buf.length;
@@ -416,14 +557,15 @@ static void mmapInit()
 		        mmap(NULL /* start anywhere */, buf.length, PROT_READ | PROT_WRITE /* required */, MAP_SHARED /* recommended */, v4l2.fd, buf.m.offset);
 
 		if (MAP_FAILED == v4l2.buffers[v4l2.n_buffers].start) {
-			errno_exit("mmap");
+			return errno_fail("mmap");
 		}
 	}
+	return 0;
 }
 #endif
 
 #ifdef IO_USERPTR
-static void userptrInit(unsigned int buffer_size)
+static int userptrInit(unsigned int buffer_size)
 {
 	struct v4l2_requestbuffers req;
 	unsigned int page_size;
@@ -440,50 +582,100 @@ static void userptrInit(unsigned int buffer_size)
 	if (-1 == xioctl(v4l2.fd, VIDIOC_REQBUFS, &req)) {
 		if (EINVAL == errno) {
 			fprintf(stderr, "%s does not support user pointer i/o\n", v4l2.deviceName);
-			exit(EXIT_FAILURE);
+			return -1;
 		} else {
-			errno_exit("VIDIOC_REQBUFS");
+			return errno_fail("VIDIOC_REQBUFS");
 		}
 	}
 
 	v4l2.buffers = (struct buffer*)calloc(4, sizeof(struct buffer));
 	if (!v4l2.buffers) {
 		fprintf(stderr, "Out of memory\n");
-		exit(EXIT_FAILURE);
+		return -1;
 	}
 
 	for (v4l2.n_buffers = 0; v4l2.n_buffers < 4; ++v4l2.n_buffers) {
 		v4l2.buffers[v4l2.n_buffers].length = buffer_size;
-		v4l2.buffers[v4l2.n_buffers].start = memalign(/* boundary */ page_size, buffer_size);
+		v4l2.buffers[v4l2.n_buffers].start = rt.huge ? rt_allocOwn(buffer_size) : memalign(/* boundary */ page_size, buffer_size);
 
 		if (!v4l2.buffers[v4l2.n_buffers].start) {
 			fprintf(stderr, "Out of memory\n");
-			exit(EXIT_FAILURE);
+			return -1;
 		}
 	}
+	return 0;
 }
 #endif
 
-static void deviceInit()
+// keep the ROI inside a width x height frame, on whole YUYV pixel pairs
+static int roiClip(unsigned int width, unsigned int height)
+{
+	struct v4l2_rect *r = &v4l2.roi;
+	r->left &= ~1;
+	r->width &= ~1;
+	if (r->left < 0 || r->top < 0 || r->left + 2 > (int)width || r->top + 2 > (int)height || r->width < 2 || r->height < 2) {
+		fprintf(stderr, "ROI %ux%u+%d+%d is outside the %ux%u frame\n", r->width, r->height, r->left, r->top, width, height);
+		return -1;
+	}
+	if (r->left + r->width > width) r->width = (width - r->left) & ~1;
+	if (r->top + r->height > height) r->height = height - r->top;
+	return 0;
+}
+
+// crop the sensor to the ROI, which is given in pixels of the WxH frame
+static int cropSelect(const struct v4l2_rect *def)
+{
+	struct v4l2_selection sel;
+
+	CLEAR(sel);
+	sel.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	sel.target = V4L2_SEL_TGT_CROP;
+	sel.r.left = def->left + (long long)v4l2.roi.left * def->width / v4l2.width;
+	sel.r.top = def->top + (long long)v4l2.roi.top * def->height / v4l2.height;
+	sel.r.width = (long long)v4l2.roi.width * def->width / v4l2.width;
+	sel.r.height = (long long)v4l2.roi.height * def->height / v4l2.height;
+	return 0 == xioctl(v4l2.fd, VIDIOC_S_SELECTION, &sel);
+}
+
+static int formatSet(struct v4l2_format *fmt, unsigned int width, unsigned int height)
+{
+	CLEAR(*fmt);
+
+	// v4l2_format
+	fmt->type                = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	fmt->fmt.pix.width       = width;
+	fmt->fmt.pix.height      = height;
+	fmt->fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+	fmt->fmt.pix.field       = V4L2_FIELD_INTERLACED;
+
+	if (-1 == xioctl(v4l2.fd, VIDIOC_S_FMT, fmt)) {
+		return errno_fail("VIDIOC_S_FMT");
+	}
+	return 0;
+}
+
+static int deviceInit()
 {
 	struct v4l2_capability cap;
 	struct v4l2_cropcap cropcap;
 	struct v4l2_crop crop;
 	struct v4l2_format fmt;
+	struct v4l2_rect def = { 0, 0, v4l2.width, v4l2.height };
 	unsigned int min;
+	int hw = 0;
 
 	if (-1 == xioctl(v4l2.fd, VIDIOC_QUERYCAP, &cap)) {
 		if (EINVAL == errno) {
 			fprintf(stderr, "%s is no V4L2 device\n", v4l2.deviceName);
-			exit(EXIT_FAILURE);
+			return -1;
 		} else {
-			errno_exit("VIDIOC_QUERYCAP");
+			return errno_fail("VIDIOC_QUERYCAP");
 		}
 	}
 
 	if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE)) {
 		fprintf(stderr, "%s is no video capture device\n", v4l2.deviceName);
-		exit(EXIT_FAILURE);
+		return -1;
 	}
 
 	switch (v4l2.io) {
@@ -491,7 +683,7 @@ static void deviceInit()
 	case IO_METHOD_READ:
 		if (!(cap.capabilities & V4L2_CAP_READWRITE)) {
 			fprintf(stderr, "%s does not support read i/o\n", v4l2.deviceName);
-			exit(EXIT_FAILURE);
+			return -1;
 		}
 		break;
 #endif
@@ -505,7 +697,7 @@ static void deviceInit()
 #if defined(IO_MMAP) || defined(IO_USERPTR)
 		if (!(cap.capabilities & V4L2_CAP_STREAMING)) {
 			fprintf(stderr, "%s does not support streaming i/o\n", v4l2.deviceName);
-			exit(EXIT_FAILURE);
+			return -1;
 		}
 		break;
 #endif
@@ -517,6 +709,7 @@ static void deviceInit()
 	cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 
 	if (0 == xioctl(v4l2.fd, VIDIOC_CROPCAP, &cropcap)) {
+		def = cropcap.defrect;
 		crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 		crop.c = cropcap.defrect; /* reset to default */
 
@@ -533,17 +726,28 @@ static void deviceInit()
 		// Errors ignored.*/
 	}
 
-	CLEAR(fmt);
-
-	// v4l2_format
-	fmt.type                = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	fmt.fmt.pix.width       = v4l2.width;
-	fmt.fmt.pix.height      = v4l2.height;
-	fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
-	fmt.fmt.pix.field       = V4L2_FIELD_INTERLACED;
-
-	if (-1 == xioctl(v4l2.fd, VIDIOC_S_FMT, &fmt)) {
-		errno_exit("VIDIOC_S_FMT");
+	// only the ROI leaves the sensor when the driver can crop to it
+	if (v4l2.roi.width) {
+		if (roiClip(v4l2.width, v4l2.height)) return -1;
+		hw = cropSelect(&def);
+	}
+	if (hw) {
+		if (formatSet(&fmt, v4l2.roi.width, v4l2.roi.height)) return -1;
+		if (fmt.fmt.pix.width == v4l2.roi.width && fmt.fmt.pix.height == v4l2.roi.height) {
+			v4l2.width = v4l2.roi.width;
+			v4l2.height = v4l2.roi.height;
+		} else {
+			crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+			crop.c = def;
+			xioctl(v4l2.fd, VIDIOC_S_CROP, &crop);
+			hw = 0;
+		}
+	}
+	if (!hw) {
+		if (v4l2.roi.width) {
+			fprintf(stderr, "%s cannot crop, cropping in software.\n", v4l2.deviceName);
+		}
+		if (formatSet(&fmt, v4l2.width, v4l2.height)) return -1;
 	}
 
 	/* Note VIDIOC_S_FMT may change width and height. */
@@ -556,6 +760,26 @@ static void deviceInit()
 		fprintf(stderr, "Image height set to %i by device %s.\n", v4l2.height, v4l2.deviceName);
 	}
 
+	// frame interval, so the driver does not capture frames we drop
+	if (v4l2.fps > 0) {
+		struct v4l2_streamparm parm;
+
+		CLEAR(parm);
+		parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		if (0 == xioctl(v4l2.fd, VIDIOC_G_PARM, &parm) && (parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME)) {
+			parm.parm.capture.timeperframe.numerator = 1000;
+			parm.parm.capture.timeperframe.denominator = v4l2.fps * 1000 + 0.5;
+			if (0 == xioctl(v4l2.fd, VIDIOC_S_PARM, &parm) && parm.parm.capture.timeperframe.numerator) {
+				float fps = (float)parm.parm.capture.timeperframe.denominator / parm.parm.capture.timeperframe.numerator;
+				if (fabsf(fps - v4l2.fps) > 0.01f) {
+					fprintf(stderr, "Frame rate set to %g by device %s.\n", fps, v4l2.deviceName);
+				}
+			}
+		} else {
+			fprintf(stderr, "%s does not support setting the frame rate\n", v4l2.deviceName);
+		}
+	}
+
 	/* Buggy driver paranoia. */
 	min = fmt.fmt.pix.width * 2;
 	if (fmt.fmt.pix.bytesperline < min) {
@@ -566,59 +790,144 @@ static void deviceInit()
 		fmt.fmt.pix.sizeimage = min;
 	}
 
+	// the rest of the pipeline sees the ROI only
+	if (v4l2.roi.width && !hw) {
+		if (roiClip(v4l2.width, v4l2.height)) return -1;
+		v4l2.stride = fmt.fmt.pix.bytesperline;
+		v4l2.crop = (unsigned char*)rt_allocOwn(v4l2.roi.width * v4l2.roi.height * 2);
+		if (!v4l2.crop) {
+			fprintf(stderr, "Out of memory\n");
+			return -1;
+		}
+		v4l2.width = v4l2.roi.width;
+		v4l2.height = v4l2.roi.height;
+	}
+
 	switch (v4l2.io) {
 #ifdef IO_READ
 	case IO_METHOD_READ:
-		readInit(fmt.fmt.pix.sizeimage);
-		break;
+		return readInit(fmt.fmt.pix.sizeimage);
 #endif
 #ifdef IO_MMAP
 	case IO_METHOD_MMAP:
-		mmapInit();
-		break;
+		return mmapInit();
 #endif
 #ifdef IO_USERPTR
 	case IO_METHOD_USERPTR:
-		userptrInit(fmt.fmt.pix.sizeimage);
+		return userptrInit(fmt.fmt.pix.sizeimage);
 #endif
 	}
+	return 0;
 }
 
-static void v4l2_deviceClose()
+// buffers and file descriptor, what a reopen replaces
+static void deviceRelease()
 {
-	free(v4l2.rgb);
+	rt_free(v4l2.crop);
+	v4l2.crop = 0;
+	v4l2.holding = 0;
 	deviceUninit();
 
-	if (-1 == close(v4l2.fd)) {
-		errno_exit("close");
-	}
+	if (v4l2.fd >= 0) close(v4l2.fd);
 	v4l2.fd = -1;
 }
 
-static void v4l2_deviceOpen()
+static int deviceStart()
 {
 	struct stat st;
 
 	// stat file
 	if (-1 == stat(v4l2.deviceName, &st)) {
 		fprintf(stderr, "Cannot identify '%s': %d, %s\n", v4l2.deviceName, errno, strerror(errno));
-		exit(EXIT_FAILURE);
+		return -1;
 	}
 
 	// check if its device
 	if (!S_ISCHR(st.st_mode)) {
 		fprintf(stderr, "%s is no device\n", v4l2.deviceName);
-		exit(EXIT_FAILURE);
+		return -1;
 	}
 
 	// open device
 	v4l2.fd = open(v4l2.deviceName, O_RDWR /* required */ | O_NONBLOCK, 0);
 	if (-1 == v4l2.fd) {
 		fprintf(stderr, "Cannot open '%s': %d, %s\n", v4l2.deviceName, errno, strerror(errno));
-		exit(EXIT_FAILURE);
+		return -1;
+	}
+
+	v4l2.width = v4l2.askWidth;
+	v4l2.height = v4l2.askHeight;
+	if (deviceInit()) {
+		deviceRelease();
+		return -1;
+	}
+	return 0;
+}
+
+static void v4l2_deviceClose()
+{
+	rt_free(v4l2.rgb);
+	v4l2.rgb = 0;
+	deviceRelease();
+}
+
+static int v4l2_deviceOpen()
+{
+	v4l2.askWidth = v4l2.width;
+	v4l2.askHeight = v4l2.height;
+	if (deviceStart()) return -1;
+	v4l2.rgb = (unsigned char*)rt_alloc(v4l2.width * v4l2.height *3);
+	if (!v4l2.rgb) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
 	}
+	return 0;
+}
+
+// no frame for 2 seconds or 4 frame intervals, whichever is longer
+static int v4l2_stalled()
+{
+	long long t = v4l2.fps > 0 ? 4000000 / v4l2.fps : 0;
+	return v4l2_now() - v4l2.last > (t > 2000000 ? t : 2000000);
+}
 
-	deviceInit();
-	v4l2.rgb = (unsigned char*)malloc(v4l2.width * v4l2.height *3);
+// close and reopen the device with the same frame size until it streams again or *quit,
+// everything after the capture keeps running
+static int v4l2_recover(volatile sig_atomic_t *quit)
+{
+	unsigned int width = v4l2.width, height = v4l2.height;
+	int wait = 20;		// msec before the next attempt
+
+	if (!v4l2.lost) {
+		v4l2.lost = v4l2.last;
+		v4l2.attempts = 0;
+		fprintf(stderr, "%s failed, reopening\n", v4l2.deviceName);
+	}
+	while (!*quit) {
+		v4l2.attempts++;
+		if (v4l2.fd >= 0) v4l2_captureStop();
+		deviceRelease();
+		if (!deviceStart()) {
+			if (v4l2.width == width && v4l2.height == height && !v4l2_captureStart()) {
+				return 0;
+			}
+			if (v4l2.width != width || v4l2.height != height) {
+				fprintf(stderr, "%s came back at %ux%u instead of %ux%u\n", v4l2.deviceName, v4l2.width, v4l2.height, width, height);
+			}
+			deviceRelease();
+			v4l2.width = width;
+			v4l2.height = height;
+		}
+		// unplugged, poll for it to come back
+		usleep(wait * 1000);
+		if (wait < 500) wait *= 2;
+	}
+	return -1;
 }
 
+static void v4l2_report()
+{
+	if (!v4l2.outages) return;
+	fprintf(stderr, "%s: %d outages, %.1f s without frames, longest %.0f ms\n",
+		v4l2.deviceName, v4l2.outages, v4l2.down/1000000.0, v4l2.downMax/1000.0);
+}